@@ -1,6 +1,8 @@
+#define _POSIX_C_SOURCE 200809L
 #ifndef M_PI
   #define M_PI 3.1415926535897932384
 #endif
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -12,11 +14,41 @@
 #include <portaudio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
 #include <ncurses.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define X86_SIMD
+  #include <immintrin.h>
+#endif
 
 static uint32_t const PAL_CLOCK = 3546895;
-static double const SAMPLE_RATE = 48000;
 static double const FINETUNE_BASE = 1.0072382087;
+//rows between seek index checkpoints, i.e. the most replayed on a seek
+static int const CHECKPOINT_ROWS = 16;
+//audio rendered ahead for the next song of a playlist
+static int const PRELOAD_MS = 250;
+//6CHN, 8CHN and xxCH mods go up to 32 channels
+#define MAX_CHANNELS 32
+//taps in the windowed sinc interpolator, and how many phases it has tables for
+#define SINC_TAPS 16
+#define SINC_PHASES 512
+//frames of padding either side of each sample and loop in the float store,
+//as many as the widest interpolator reaches
+static int const SAMPLE_PAD = 8;
+//bits below int16 on the fixed point engine's bus, see mixpannedfixed()
+static int const FIXED_SHIFT = 14;
+//largest denominator of the frame carry, see steptick()
+static uint64_t const MAX_CARRYUNIT = (uint64_t)1 << 40;
+//longest possible tick, at the slowest tempo F20 (32 BPM)
+static double const MAX_TICKTIME = 1/(0.4*32);
+//the pattern view redraws at most 30 times a second
+static double const UI_FRAME_TIME = 1/30.0;
 
 uint16_t periods[] = {
   856,808,762,720,678,640,604,570,538,508,480,453,
@@ -35,43 +67,54 @@ uint8_t funktable[] = {
   0,5,6,7,8,10,11,13,16,19,22,26,32,43,64,128};
 
 WINDOW* patternwin;
+WINDOW* statswin;
 //WINDOW* instrwin;
 
+//lookup tables, filled once by precalculatetables()
 int16_t* waves[3];
 int16_t sine[64];
 int16_t saw[64];
 int16_t square[64];
+//playback rate and 16.16 mixer step for every legal period and finetune,
+//indexed [finetune&15][period-113]
+double ratetable[16][856-113+1];
+uint32_t steptable[16][856-113+1];
+//windowed sinc taps for each fractional position
+float sinctable[SINC_PHASES][SINC_TAPS];
 
 char* displaypatterns;
+char* blankline; //a pattern line with nothing in it
+int viewchannels; //channels that fit in the pattern viewer
 //int16_t randwave[64];
 
-off_t filelength;
-bool loop;
-bool headphones;
-float* audiobuf;
-float* mixbuf;
-
-int pattern;
-int row;
-int currow;
-int curpattern;
-bool addflag; //used for emualting obscure Dxx bug
-uint8_t* curdata;
-bool done;
-int libsrc_error;
+bool headless; //offline render, no ncurses or PortAudio
+pthread_t uithread; //the thread that owns ncurses
+bool quiet; //live playback without ncurses
+double samplerate = 48000; //output rate, -r
+size_t cachesize; //--cache: bytes of rendered rows to keep when looping
+volatile sig_atomic_t interrupted; //SIGINT or SIGTERM while playing quietly
+char* statsname; //--stats: where the JSON counters go, "-" for stderr
+volatile sig_atomic_t statsrequested; //SIGUSR1 while playing
+bool uselibsrc; //resample with libsamplerate instead of the built in mixer
+bool fixedpoint; //--fixed: mix in integers, see mixchannel()
+typedef enum {INTERP_NEAREST, INTERP_LINEAR, INTERP_CUBIC, INTERP_SINC,
+              NUM_INTERPS} interpolation;
+char* interpnames[NUM_INTERPS] = {"nearest", "linear", "cubic", "sinc"};
+interpolation interp = INTERP_LINEAR;
+//Amiga output filters on the mixed signal: the LED filter alone, switched
+//by E0x, or the LED filter behind a model's fixed ones
+typedef enum {FILTER_NONE, FILTER_LED, FILTER_A500, FILTER_A1200,
+              NUM_FILTERS} filtermodel;
+char* filternames[NUM_FILTERS] = {"none", "led", "a500", "a1200"};
+filtermodel outputfilter = FILTER_LED;
 PaStream* stream;
 PaError pa_error;
-uint8_t globaltick;
-bool patternset;
-uint8_t delcount;
-bool delset;
-bool inrepeat;
-double ticktime;
-double nextticktime;
-uint8_t nexttempo;
-uint8_t nextspeed;
-uint8_t numsamples;
-uint8_t type;
+//--latency: what PortAudio is asked to buffer, "low" or "high" for the
+//device's own figures or a number of ms
+char* devicelatency = "high";
+//--block: frames per audio callback, 0 (paFramesPerBufferUnspecified) lets
+//PortAudio pick
+unsigned long blockframes = paFramesPerBufferUnspecified;
 
 typedef struct {
   char name[23];
@@ -80,7 +123,19 @@ typedef struct {
   uint8_t volume;
   uint16_t repeatpoint;
   uint16_t repeatlength;
-  int8_t* sampledata;
+  int8_t* sampledata; //points into the file image until the sample is written
+  bool owned; //sampledata is a private copy that must be freed
+  //sampledata as float for the built in mixer, with SAMPLE_PAD frames of
+  //silence before and of what plays after the end, so the interpolators
+  //never have to wrap. Starts SAMPLE_PAD floats into its allocation
+  float* store;
+  //a copy of just the loop, padded on both sides with its other end,
+  //NULL for one shot samples. Shares store's allocation
+  float* loopstore;
+  //the same two laid out as int8 for the fixed point engine, which builds
+  //these instead of the float ones
+  int8_t* store8;
+  int8_t* loopstore8;
 } sample;
 
 typedef struct{
@@ -90,13 +145,14 @@ typedef struct{
   uint32_t index;
   float* buffer;
   float* resampled;
-  uint32_t increment;
+  uint32_t increment; //16.16 fixed point step through the sample per frame
   bool repeat;
   bool stop;
   uint8_t deltick;
   uint16_t period;
   uint16_t arp[3];
   uint16_t portdest;
+  int8_t portnote; //portdest's index in periods[], -1 if it isn't there
   uint16_t tempperiod;
   uint8_t portstep;
   uint8_t cut;
@@ -118,22 +174,237 @@ typedef struct{
   int8_t loopcount;
   uint16_t offset;
   uint16_t offsetmem;
-  float error;
+  uint32_t error; //fractional part of index (16 bit)
+  double sourcecarry; //libsamplerate path: fraction of a frame not yet fed
+  float pan[2]; //left and right gain, set once by initsound()
+  int32_t ipan[2]; //the same for the fixed point engine, see mixpannedfixed()
 } channel;
 
+//every pattern decoded once at load, one entry per note in pattern, row,
+//channel order. All the arrays share the block period points to
+typedef struct{
+  uint16_t* period; //0 for no note
+  int8_t* note; //index into periods[], -1 for no note or one off the table
+  uint8_t* sample; //1 based, 0 for none
+  uint8_t* effect;
+  uint8_t* param;
+} notetable;
+
 typedef struct{
   char name[21];
-  uint8_t* patterns;
+  notetable notes;
   uint8_t songlength;
   sample* samples[31];
   uint8_t patternlist[128];
   uint32_t speed;
   uint16_t tempo;
   char magicstring[5];
+  uint8_t numsamples;
+  uint8_t type;
+  uint8_t numchannels;
+  uint8_t* image; //file image owned by the module, NULL if the caller owns it
+  size_t imagelength;
+  bool mapped; //image came from mmap rather than malloc
 } modfile;
 
-modfile* gm;
-channel* gcp;
+//notetable index of the first note of a row in the pattern played at order
+static inline uint32_t rownote(const modfile* m, int order, int row)
+{
+  return ((uint32_t)m->patternlist[order]*64 + row)*m->numchannels;
+}
+
+//one second order section, normalised so a0 is 1
+typedef struct{
+  double b0, b1, b2;
+  double a1, a2;
+} biquad;
+
+//the same with Q28 coefficients, for the fixed point engine
+typedef struct{
+  int64_t b0, b1, b2;
+  int64_t a1, a2;
+} fixedbiquad;
+
+//a biquad's memory for each stereo lane, transposed direct form II
+typedef struct{
+  double z1[2];
+  double z2[2];
+  int64_t q1[2]; //the fixed point engine's, in Q28 bus units
+  int64_t q2[2];
+} biquadstate;
+
+//filter coefficients for the output rate, set by precalculatetables()
+biquad ledfilter;
+biquad lowpassfilter;
+biquad highpassfilter;
+fixedbiquad ledfixed;
+fixedbiquad lowpassfixed;
+fixedbiquad highpassfixed;
+bool haslowpass; //the model has a low pass below the output's Nyquist
+
+//where --bench splits the render time
+typedef enum {STAGE_SEQUENCER, STAGE_EXPAND, STAGE_RESAMPLE, STAGE_MIX,
+              STAGE_OUTPUT, NUM_STAGES} stage;
+
+/*live playback counters. The render thread owns the tick and channel
+  figures and the UI thread the draw figures, each written with relaxed
+  atomics so the other thread, or a dump, can read them at any time*/
+typedef struct{
+  uint64_t ticks;
+  uint64_t tickns; //total render time
+  uint64_t audions; //total length of the ticks rendered
+  uint32_t tickmin; //ns
+  uint32_t tickmax;
+  uint32_t loadmax; //worst render time over tick length, in 1/10000ths
+  uint32_t histogram[4096]; //ticks by render time, 10us per bucket
+  uint64_t channelns[MAX_CHANNELS]; //time in processnote() for each channel
+  int numchannels;
+  uint64_t draws;
+  uint64_t drawns;
+  uint32_t drawmax;
+} perfstats;
+
+//everything needed to play one song, so several can run side by side
+typedef struct{
+  modfile* mod;
+  channel* channels;
+  float* audiobuf;
+  float* channelbuf; //one channel's frames before they go into audiobuf
+  int32_t* fixedbus; //fixed point engine: the stereo mix, and
+  int16_t* fixedbuf; //one channel's frames as Q8 samples,
+  int16_t* pcm; //and the finished tick
+  bool loop;
+  bool headphones;
+  uint8_t separation; //stereo separation in percent, 100 is Amiga hard panning
+  bool led; //LED filter switched on by E00
+  biquadstate lowpass; //the model's fixed filters
+  biquadstate highpass;
+  biquadstate ledstate;
+  bool visited[128]; //orders already played, used to end offline renders
+
+  int pattern;
+  int row;
+  int currow;
+  int curpattern;
+  bool addflag; //used for emualting obscure Dxx bug
+  uint32_t curnote; //first note of the current row, see rownote()
+  bool done;
+  uint8_t globaltick;
+  bool patternset;
+  uint8_t delcount;
+  bool delset;
+  bool inrepeat;
+  double ticktime;
+  double nextticktime;
+  int tickframes; //output frames in the current tick
+  uint64_t framecarry; //frames the earlier ticks left over, over carryunit
+  uint64_t carryunit;
+  uint8_t nexttempo;
+  uint8_t nextspeed;
+  bool profile; //time each stage into stagetime, only used by --bench
+  double stagetime[NUM_STAGES];
+  bool silent; //run the sequencer only, moving sample positions arithmetically
+  perfstats* stats; //live playback counters, NULL when not playing live
+  bool stopatloop; //end the song on a jump back to an order already played
+  uint64_t frame; //output frames since the start of the song
+} player;
+
+//one row as the song really plays it, with jumps and loops unrolled
+typedef struct{
+  uint64_t frame;
+  uint8_t order;
+  uint8_t row;
+} rowmark;
+
+//everything playback depends on at the start of a row
+typedef struct{
+  player state; //only the sequencer fields are restored
+  channel* channels; //mod->numchannels of them
+  int8_t finetunes[31]; //E5x changes these
+  uint32_t speed;
+  uint16_t tempo;
+} checkpoint;
+
+//built at load time by a sequencer only pass over the song
+typedef struct{
+  rowmark* rows;
+  int numrows;
+  checkpoint* checkpoints; //every CHECKPOINT_ROWS rows
+  int numcheckpoints;
+  uint64_t orderframes[128]; //first frame of each order, UINT64_MAX if unused
+  uint64_t length; //frames in one pass through the song
+  uint64_t loopstart; //where a song that jumps back carries on, or UINT64_MAX
+} seekindex;
+
+//single producer, single consumer ring of stereo frames: only the render
+//thread moves write and only the audio callback moves read
+typedef struct{
+  float* data;
+  uint32_t size; //in frames, always a power of two
+  uint32_t write;
+  uint32_t read;
+  uint32_t flush; //the consumer skips ahead to here, set after a seek
+} ring;
+
+//a playlist entry loaded on its own thread while the song before it plays,
+//with its seek index built and its first PRELOAD_MS of audio rendered
+typedef struct{
+  player p;
+  seekindex index;
+  int number; //position in the playlist
+  char* name;
+  float* lead;
+  uint32_t leadframes;
+  bool ok; //loaded, set by the loading thread
+  pthread_t thread;
+} nextsong;
+
+//live playback: a render thread keeps the ring topped up to target frames
+//while the PortAudio callback drains it and the UI runs in the main thread
+typedef struct{
+  player* p;
+  ring buffer;
+  uint32_t target;
+  uint32_t lowwater; //the render thread waits for the ring to drain to here
+  double nap; //ms the render thread sleeps while the ring is full enough
+  double outputlatency; //s, what PortAudio settled on
+  uint32_t callbackmax; //most frames asked for in one callback
+  bool paused;
+  bool quit;
+  bool finished; //the render thread reached the end of the song
+  int32_t seekms; //relative seeks asked for by the UI, taken by the renderer
+  int32_t seekorders;
+  seekindex index;
+  uint32_t underruns;
+  uint64_t position; //last rendered row, see publishposition()
+  pthread_t thread;
+  perfstats stats;
+  struct rendercache* cache; //NULL unless --cache and -l
+  //the cache's counters as last read, kept for the dump after it is freed
+  bool cached;
+  uint64_t cachehits;
+  uint64_t cachemisses;
+  uint64_t cachebytes;
+  //playlists: the render thread moves straight on to the next song, which
+  //has been loading in the background, and leaves the old one in retired
+  //for the main thread to free once the view has let go of it
+  char** songs; //NULL for a single song
+  int numsongs;
+  bool repeat; //-l, start the list again after the last song
+  player settings; //options copied into every song's player
+  int song; //playlist position of p
+  nextsong* current; //how p was loaded, NULL for the first song
+  nextsong* next;
+  player* retired;
+  nextsong* retiredsong;
+  seekindex retiredindex;
+  float* lead; //the current song's preloaded audio still to be queued
+  uint32_t leadframes;
+  uint32_t leadpos;
+  uint16_t sequence; //bumped on every change of song, see publishposition()
+  player* viewplayer; //main thread: the song the view was built for
+  uint16_t viewsequence;
+} playback;
 
 int findperiod(uint16_t period)
 {
@@ -155,10 +426,52 @@ int findperiod(uint16_t period)
   return -1;*/
 }
 
+//period must already be clamped to 113-856
 static inline double calcrate(uint16_t period, int8_t finetune)
 {
-  return PAL_CLOCK/
-    (round((double)period*pow(FINETUNE_BASE, -(double)finetune)));
+  return ratetable[finetune&15][period-113];
+}
+
+static inline uint32_t calcstep(uint16_t period, int8_t finetune)
+{
+  return steptable[finetune&15][period-113];
+}
+
+double now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec/1e9;
+}
+
+//adds to a counter only one thread writes, so a relaxed load and store do
+static inline void bump(uint64_t* counter, uint64_t n)
+{
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED)+n,
+    __ATOMIC_RELAXED);
+}
+
+//stage timing for --bench, costs nothing unless p->profile is set
+static inline double profilestart(player* p)
+{
+  return p->profile ? now() : 0;
+}
+
+static inline void profileend(player* p, stage s, double start)
+{
+  if(p->profile) p->stagetime[s] += now()-start;
+}
+
+//output frames in the longest possible tick
+int maxtickframes()
+{
+  return ceil(MAX_TICKTIME*samplerate)+1;
+}
+
+//sample frames played in the longest tick at the highest pitch
+int maxsourceframes()
+{
+  return ceil(maxtickframes()*calcrate(113, 7)/samplerate)+1;
 }
 
 //Currently unused because of funkrepeat
@@ -168,18 +481,275 @@ static inline double calcrate(uint16_t period, int8_t finetune)
     dest[i] = ((float)src[i])/128.0f;
 }*/
 
+/*mixing kernels, picked once at startup by selectkernels(). The scalar
+  versions work everywhere, the SSE2/AVX2 ones give the same results*/
+
+//add in*gain into one lane of interleaved stereo at out
+void mixlanescalar(float* out, const float* in, int frames, float gain)
+{
+  for(int i = 0; i < frames; i++) out[i*2] += in[i]*gain;
+}
+
+//sample data to float, with the channel volume folded into gain
+void convertscalar(float* out, const int8_t* in, int n, float gain)
+{
+  for(int i = 0; i < n; i++) out[i] = in[i]*gain;
+}
+
+//headphones mixing, in place
+void crossfeedscalar(float* buf, int frames)
+{
+  for(int i = 0; i < frames; i++)
+  {
+    float l = buf[i*2];
+    float r = buf[i*2+1];
+    buf[i*2] = l+0.5f*r;
+    buf[i*2+1] = r+0.5f*l;
+  }
+}
+
+//clip and pack to 16 bit little endian
+void packs16scalar(uint8_t* out, const float* in, int n)
+{
+  for(int i = 0; i < n; i++)
+  {
+    float v = in[i];
+    if(v > 1.0f) v = 1.0f;
+    else if(v < -1.0f) v = -1.0f;
+    uint16_t word = (uint16_t)(int16_t)lrintf(v*32767.0f);
+    out[i*2] = word&0xFF;
+    out[i*2+1] = word>>8;
+  }
+}
+
+#ifdef X86_SIMD
+//the vector loops stop one frame early so loads at out+1 stay in the frame
+__attribute__((target("sse2")))
+void mixlanesse2(float* out, const float* in, int frames, float gain)
+{
+  __m128 g = _mm_set1_ps(gain);
+  __m128 negzero = _mm_set1_ps(-0.0f); //x + -0 == x, even for -0
+  int i = 0;
+  for(; i+4 < frames; i += 4)
+  {
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(in+i), g);
+    __m128 a = _mm_add_ps(_mm_loadu_ps(out+i*2), _mm_unpacklo_ps(v, negzero));
+    __m128 b = _mm_add_ps(_mm_loadu_ps(out+i*2+4),
+                          _mm_unpackhi_ps(v, negzero));
+    _mm_storeu_ps(out+i*2, a);
+    _mm_storeu_ps(out+i*2+4, b);
+  }
+  mixlanescalar(out+i*2, in+i, frames-i, gain);
+}
+
+__attribute__((target("sse2")))
+void convertsse2(float* out, const int8_t* in, int n, float gain)
+{
+  __m128 g = _mm_set1_ps(gain);
+  int i = 0;
+  for(; i+16 <= n; i += 16)
+  {
+    //sign extend by unpacking each byte into the top of a wider lane
+    __m128i x = _mm_loadu_si128((const __m128i*)(in+i));
+    __m128i lo = _mm_srai_epi16(_mm_unpacklo_epi8(x, x), 8);
+    __m128i hi = _mm_srai_epi16(_mm_unpackhi_epi8(x, x), 8);
+    __m128i w[4] = {_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16),
+                    _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16),
+                    _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16),
+                    _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)};
+    for(int j = 0; j < 4; j++)
+      _mm_storeu_ps(out+i+j*4, _mm_mul_ps(_mm_cvtepi32_ps(w[j]), g));
+  }
+  convertscalar(out+i, in+i, n-i, gain);
+}
+
+__attribute__((target("sse2")))
+void crossfeedsse2(float* buf, int frames)
+{
+  __m128 half = _mm_set1_ps(0.5f);
+  int i = 0;
+  for(; i+2 <= frames; i += 2)
+  {
+    __m128 v = _mm_loadu_ps(buf+i*2);
+    __m128 swapped = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+    _mm_storeu_ps(buf+i*2, _mm_add_ps(v, _mm_mul_ps(swapped, half)));
+  }
+  crossfeedscalar(buf+i*2, frames-i);
+}
+
+//x86 is little endian, so the packed words can be stored as they are
+__attribute__((target("sse2")))
+void packs16sse2(uint8_t* out, const float* in, int n)
+{
+  __m128 one = _mm_set1_ps(1.0f);
+  __m128 minusone = _mm_set1_ps(-1.0f);
+  __m128 scale = _mm_set1_ps(32767.0f);
+  int i = 0;
+  for(; i+8 <= n; i += 8)
+  {
+    __m128 a = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(in+i), one), minusone);
+    __m128 b = _mm_max_ps(_mm_min_ps(_mm_loadu_ps(in+i+4), one), minusone);
+    __m128i words = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(a, scale)),
+                                    _mm_cvtps_epi32(_mm_mul_ps(b, scale)));
+    _mm_storeu_si128((__m128i*)(out+i*2), words);
+  }
+  packs16scalar(out+i*2, in+i, n-i);
+}
+
+__attribute__((target("avx2")))
+void mixlaneavx2(float* out, const float* in, int frames, float gain)
+{
+  __m256 g = _mm256_set1_ps(gain);
+  __m256 negzero = _mm256_set1_ps(-0.0f);
+  int i = 0;
+  for(; i+8 < frames; i += 8)
+  {
+    __m256 v = _mm256_mul_ps(_mm256_loadu_ps(in+i), g);
+    __m256 lo = _mm256_unpacklo_ps(v, negzero);
+    __m256 hi = _mm256_unpackhi_ps(v, negzero);
+    __m256 first = _mm256_permute2f128_ps(lo, hi, 0x20);
+    __m256 second = _mm256_permute2f128_ps(lo, hi, 0x31);
+    _mm256_storeu_ps(out+i*2, _mm256_add_ps(_mm256_loadu_ps(out+i*2), first));
+    _mm256_storeu_ps(out+i*2+8,
+                     _mm256_add_ps(_mm256_loadu_ps(out+i*2+8), second));
+  }
+  mixlanescalar(out+i*2, in+i, frames-i, gain);
+}
+
+__attribute__((target("avx2")))
+void convertavx2(float* out, const int8_t* in, int n, float gain)
+{
+  __m256 g = _mm256_set1_ps(gain);
+  int i = 0;
+  for(; i+8 <= n; i += 8)
+  {
+    __m256i x = _mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(in+i)));
+    _mm256_storeu_ps(out+i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), g));
+  }
+  convertscalar(out+i, in+i, n-i, gain);
+}
+
+__attribute__((target("avx2")))
+void crossfeedavx2(float* buf, int frames)
+{
+  __m256 half = _mm256_set1_ps(0.5f);
+  int i = 0;
+  for(; i+4 <= frames; i += 4)
+  {
+    __m256 v = _mm256_loadu_ps(buf+i*2);
+    __m256 swapped = _mm256_permute_ps(v, _MM_SHUFFLE(2, 3, 0, 1));
+    _mm256_storeu_ps(buf+i*2, _mm256_add_ps(v, _mm256_mul_ps(swapped, half)));
+  }
+  crossfeedscalar(buf+i*2, frames-i);
+}
+
+__attribute__((target("avx2")))
+void packs16avx2(uint8_t* out, const float* in, int n)
+{
+  __m256 one = _mm256_set1_ps(1.0f);
+  __m256 minusone = _mm256_set1_ps(-1.0f);
+  __m256 scale = _mm256_set1_ps(32767.0f);
+  int i = 0;
+  for(; i+16 <= n; i += 16)
+  {
+    __m256 a = _mm256_max_ps(_mm256_min_ps(_mm256_loadu_ps(in+i), one),
+                             minusone);
+    __m256 b = _mm256_max_ps(_mm256_min_ps(_mm256_loadu_ps(in+i+8), one),
+                             minusone);
+    //packs works within 128 bit halves, so put the quarters back in order
+    __m256i words = _mm256_packs_epi32(
+      _mm256_cvtps_epi32(_mm256_mul_ps(a, scale)),
+      _mm256_cvtps_epi32(_mm256_mul_ps(b, scale)));
+    words = _mm256_permute4x64_epi64(words, 0xD8);
+    _mm256_storeu_si256((__m256i*)(out+i*2), words);
+  }
+  packs16scalar(out+i*2, in+i, n-i);
+}
+#endif
+
+void (*mixlane)(float*, const float*, int, float) = mixlanescalar;
+void (*convert)(float*, const int8_t*, int, float) = convertscalar;
+void (*crossfeed)(float*, int) = crossfeedscalar;
+void (*packs16)(uint8_t*, const float*, int) = packs16scalar;
+
+void selectkernels()
+{
+#ifdef X86_SIMD
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse2"))
+  {
+    mixlane = mixlanesse2;
+    convert = convertsse2;
+    crossfeed = crossfeedsse2;
+    packs16 = packs16sse2;
+  }
+  if(__builtin_cpu_supports("avx2"))
+  {
+    mixlane = mixlaneavx2;
+    convert = convertavx2;
+    crossfeed = crossfeedavx2;
+    packs16 = packs16avx2;
+  }
+#endif
+}
+
+//print to the ncurses screen, or to stderr when ncurses isn't running
+void report(const char* fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  if(headless || quiet) vfprintf(stderr, fmt, args);
+  //ncurses is main thread only, songs loading in the background keep quiet
+  else if(pthread_equal(pthread_self(), uithread)) vw_printw(stdscr, fmt, args);
+  va_end(args);
+}
+
 void libsrcerror(int err)
 {
-  printw("Lib SRC Error: %s\n", src_strerror(err));
+  report("Lib SRC Error: %s\n", src_strerror(err));
   abort();
 }
 
 void portaudioerror(int err)
 {
-  printw("PortAudio error: %s\n", Pa_GetErrorText(err));
+  report("PortAudio error: %s\n", Pa_GetErrorText(err));
   abort();
 }
 
+/*bilinear transform designs. The Amiga's fixed filters are single RC
+  stages, which come out as biquads with b2 and a2 zero*/
+biquad rclowpass(double cutoff)
+{
+  double k = tan(M_PI*cutoff/samplerate);
+  biquad f = {k/(1+k), k/(1+k), 0, (k-1)/(k+1), 0};
+  return f;
+}
+
+biquad rchighpass(double cutoff)
+{
+  double k = tan(M_PI*cutoff/samplerate);
+  biquad f = {1/(1+k), -1/(1+k), 0, (k-1)/(k+1), 0};
+  return f;
+}
+
+biquad lowpass2(double cutoff, double q)
+{
+  double w = 2*M_PI*cutoff/samplerate;
+  double alpha = sin(w)/(2*q);
+  double a0 = 1+alpha;
+  biquad f = {(1-cos(w))/2/a0, (1-cos(w))/a0, (1-cos(w))/2/a0,
+              -2*cos(w)/a0, (1-alpha)/a0};
+  return f;
+}
+
+fixedbiquad tofixed(biquad f)
+{
+  fixedbiquad q = {llround(f.b0*(1<<28)), llround(f.b1*(1<<28)),
+                   llround(f.b2*(1<<28)), llround(f.a1*(1<<28)),
+                   llround(f.a2*(1<<28))};
+  return q;
+}
+
 void precalculatetables()
 {
   double cursin;
@@ -196,33 +766,97 @@ void precalculatetables()
     square[i] = (i<32)?255:-256;
     //randwave[i] = (int8_t)(rand()%256);
   }
+  for(int ft = -8; ft < 8; ft++)
+  {
+    double tune = pow(FINETUNE_BASE, -(double)ft);
+    for(int period = 113; period <= 856; period++)
+    {
+      double rate = PAL_CLOCK/round(period*tune);
+      ratetable[ft&15][period-113] = rate;
+      steptable[ft&15][period-113] = rate/samplerate*65536.0;
+    }
+  }
+  /*Blackman windowed sinc, cut off at the sample's own Nyquist frequency.
+    Paula never plays faster than 31.4kHz, so at 48kHz this only ever
+    upsamples; below about 32kHz output the highest notes alias. Each
+    phase is normalised so a constant comes out unchanged*/
+  for(int phase = 0; phase < SINC_PHASES; phase++)
+  {
+    double frac = (double)phase/SINC_PHASES;
+    double sum = 0;
+    double taps[SINC_TAPS];
+    for(int j = 0; j < SINC_TAPS; j++)
+    {
+      double x = j-(SINC_TAPS/2-1)-frac;
+      double w = 0.5+0.5*x/(SINC_TAPS/2);
+      double window = 0.42-0.5*cos(2*M_PI*w)+0.08*cos(4*M_PI*w);
+      taps[j] = (x == 0 ? 1 : sin(M_PI*x)/(M_PI*x))*window;
+      sum += taps[j];
+    }
+    for(int j = 0; j < SINC_TAPS; j++) sinctable[phase][j] = taps[j]/sum;
+  }
+  /*component values from the schematics. The LED filter is a Sallen-Key
+    stage (10k, 10k, 6800pF, 3900pF), the A500 has a 360R/0.1uF low pass,
+    and the output capacitors make a high pass at about 5Hz. The A1200's
+    low pass is at 34kHz, so it only exists at rates well above 68kHz*/
+  ledfilter = lowpass2(3090.5, 0.660);
+  if(outputfilter == FILTER_A1200)
+  {
+    haslowpass = 34000 < samplerate*0.45;
+    lowpassfilter = rclowpass(34000);
+  }
+  else
+  {
+    haslowpass = outputfilter == FILTER_A500;
+    lowpassfilter = rclowpass(4421.0);
+  }
+  highpassfilter = rchighpass(outputfilter == FILTER_A1200 ? 5.32 : 5.20);
+  ledfixed = tofixed(ledfilter);
+  lowpassfixed = tofixed(lowpassfilter);
+  highpassfixed = tofixed(highpassfilter);
 }
 
-channel* initsound()
+void initsound(player* p)
 {
-  precalculatetables();
-  pa_error = Pa_Initialize();
-  if(pa_error != paNoError) portaudioerror(pa_error);
-  channel* channels = malloc(4*sizeof(channel));
-  mixbuf = malloc(0.08*2*SAMPLE_RATE*sizeof(float));
-  //buffs[1] = malloc(0.02*2*SAMPLE_RATE*sizeof(float));
+  int libsrc_error;
+  int numchannels = p->mod->numchannels;
+  channel* channels = calloc(numchannels, sizeof(channel));
+  p->channels = channels;
+  //more channels than Paula had share her headroom
+  float level = numchannels > 4 ? 4.0f/numchannels : 1.0f;
+  float separation = p->separation/100.0f;
+  //buffs[1] = malloc(0.02*2*samplerate*sizeof(float));
   //curbuf = 0;
-  audiobuf = malloc(0.08*2*SAMPLE_RATE*sizeof(float));
-  for(int i = 0; i < 4; i++)
+  p->audiobuf = malloc(maxtickframes()*2*sizeof(float));
+  p->channelbuf = malloc(maxtickframes()*sizeof(float));
+  if(fixedpoint)
   {
+    p->fixedbus = malloc(maxtickframes()*2*sizeof(int32_t));
+    p->fixedbuf = malloc(maxtickframes()*sizeof(int16_t));
+    p->pcm = malloc(maxtickframes()*2*sizeof(int16_t));
+  }
+  //silent channels are passed through libsamplerate at the output rate
+  int scratch = maxsourceframes();
+  if(maxtickframes() > scratch) scratch = maxtickframes();
+  for(int i = 0; i < numchannels; i++)
+  {
+    //LRRL like the Amiga, repeated for every group of four
+    float side = (i%4 == 0 || i%4 == 3) ? -1.0f : 1.0f;
+    channels[i].pan[0] = level*(1.0f-side*separation)/2;
+    channels[i].pan[1] = level*(1.0f+side*separation)/2;
+    for(int lane = 0; lane < 2; lane++)
+      channels[i].ipan[lane] = lrint(channels[i].pan[lane]*0.4*32767/2);
     channels[i].error = 0;
     channels[i].volume = 0;
     channels[i].tempvolume = 0;
     channels[i].deltick = 0;
-    channels[i].increment = 0.0f;
-    channels[i].buffer = malloc(PAL_CLOCK*sizeof(float));
-    //channels[i].output = malloc(1024*sizeof(float));
-    channels[i].resampled = malloc(0.08*SAMPLE_RATE*sizeof(float));
+    channels[i].increment = 0;
     channels[i].stop = true;
     channels[i].repeat = false;
     //channels[i].arp = malloc(3*sizeof(uint16_t));
     channels[i].period = 0;
     channels[i].portdest = 0;
+    channels[i].portnote = -1;
     channels[i].tempperiod = 0;
     channels[i].portstep = 0;
     channels[i].offset = 0;
@@ -238,70 +872,165 @@ channel* initsound()
     channels[i].looppoint = 0;
     channels[i].loopcount = -1;
     channels[i].sample = NULL;
-    //channels[i].converter = src_new(SRC_ZERO_ORDER_HOLD, 1, &libsrc_error);
-    channels[i].converter = src_new(SRC_LINEAR, 1, &libsrc_error);
-    //channels[i].converter = src_new(SRC_SINC_FASTEST, 1, &libsrc_error);
-    //channels[i].converter = src_new(SRC_SINC_BEST_QUALITY, 1, &libsrc_error);
-    channels[i].cdata = malloc(sizeof(SRC_DATA));
-    channels[i].cdata->data_in = channels[i].buffer;
-    channels[i].cdata->data_out = channels[i].resampled;
-    channels[i].cdata->output_frames = SAMPLE_RATE*0.02;
-    channels[i].cdata->end_of_input = 0;
-    row = 0;
-    currow = 0;
-    pattern = 0;
-    delset = false;
-    inrepeat = false;
-    delcount = 0;
-    globaltick = 0;
-    addflag = false;
+    channels[i].buffer = NULL;
+    channels[i].resampled = NULL;
+    channels[i].converter = NULL;
+    channels[i].cdata = NULL;
+    if(uselibsrc)
+    {
+      channels[i].buffer = malloc(scratch*sizeof(float));
+      //channels[i].output = malloc(1024*sizeof(float));
+      channels[i].resampled = malloc(maxtickframes()*sizeof(float));
+      //the nearest libsamplerate converter to each interpolation tier
+      int types[NUM_INTERPS] = {SRC_ZERO_ORDER_HOLD, SRC_LINEAR,
+                                SRC_SINC_FASTEST, SRC_SINC_BEST_QUALITY};
+      channels[i].converter = src_new(types[interp], 1, &libsrc_error);
+      if(libsrc_error) libsrcerror(libsrc_error);
+      channels[i].cdata = malloc(sizeof(SRC_DATA));
+      channels[i].cdata->data_in = channels[i].buffer;
+      channels[i].cdata->data_out = channels[i].resampled;
+      channels[i].cdata->output_frames = samplerate*0.02;
+      channels[i].cdata->end_of_input = 0;
+    }
+    p->row = 0;
+    p->currow = 0;
+    p->pattern = 0;
+    p->delset = false;
+    p->inrepeat = false;
+    p->delcount = 0;
+    p->globaltick = 0;
+    p->addflag = false;
   }
-  //open the audio stream
-  pa_error = Pa_OpenDefaultStream(&stream, 0, 2, paFloat32, SAMPLE_RATE,
-                                  paFramesPerBufferUnspecified, NULL,
-                                  audiobuf);
+  memset(p->visited, 0, sizeof(p->visited));
+  p->led = false;
+  memset(&p->lowpass, 0, sizeof(biquadstate));
+  memset(&p->highpass, 0, sizeof(biquadstate));
+  memset(&p->ledstate, 0, sizeof(biquadstate));
+  p->done = false;
+  p->framecarry = 0;
+  p->carryunit = 0;
+  p->patternset = false;
+  p->curpattern = 0;
+}
+
+void ringinit(ring* r, uint32_t frames)
+{
+  r->size = 1;
+  while(r->size < frames) r->size <<= 1;
+  r->data = malloc(r->size*2*sizeof(float));
+  r->write = 0;
+  r->read = 0;
+  r->flush = 0;
+}
+
+uint32_t ringfill(ring* r)
+{
+  return __atomic_load_n(&r->write, __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&r->read, __ATOMIC_ACQUIRE);
+}
+
+//producer side, the caller makes sure there is room
+void ringwrite(ring* r, const float* buf, uint32_t frames)
+{
+  uint32_t w = __atomic_load_n(&r->write, __ATOMIC_RELAXED);
+  uint32_t start = w & (r->size-1);
+  uint32_t first = r->size-start < frames ? r->size-start : frames;
+  memcpy(r->data+start*2, buf, first*2*sizeof(float));
+  memcpy(r->data, buf+first*2, (frames-first)*2*sizeof(float));
+  __atomic_store_n(&r->write, w+frames, __ATOMIC_RELEASE);
+}
+
+//producer side, drops everything written so far once the consumer sees it
+void ringflush(ring* r)
+{
+  __atomic_store_n(&r->flush, __atomic_load_n(&r->write, __ATOMIC_RELAXED),
+                   __ATOMIC_RELEASE);
+}
+
+//consumer side, returns the number of frames actually read
+uint32_t ringread(ring* r, float* buf, uint32_t frames)
+{
+  uint32_t rd = __atomic_load_n(&r->read, __ATOMIC_RELAXED);
+  uint32_t flush = __atomic_load_n(&r->flush, __ATOMIC_ACQUIRE);
+  if((int32_t)(flush-rd) > 0) rd = flush;
+  uint32_t avail = __atomic_load_n(&r->write, __ATOMIC_ACQUIRE) - rd;
+  if(frames > avail) frames = avail;
+  uint32_t start = rd & (r->size-1);
+  uint32_t first = r->size-start < frames ? r->size-start : frames;
+  memcpy(buf, r->data+start*2, first*2*sizeof(float));
+  memcpy(buf+first*2, r->data, (frames-first)*2*sizeof(float));
+  __atomic_store_n(&r->read, rd+frames, __ATOMIC_RELEASE);
+  return frames;
+}
+
+//runs on the PortAudio thread: no locks, no allocation, no ncurses
+int audiocallback(const void* input, void* output, unsigned long frames,
+                  const PaStreamCallbackTimeInfo* timeinfo,
+                  PaStreamCallbackFlags flags, void* data)
+{
+  (void)input;
+  (void)timeinfo;
+  playback* pb = data;
+  float* out = output;
+  uint32_t got = 0;
+  if(frames > __atomic_load_n(&pb->callbackmax, __ATOMIC_RELAXED))
+    __atomic_store_n(&pb->callbackmax, frames, __ATOMIC_RELAXED);
+  if(!__atomic_load_n(&pb->paused, __ATOMIC_RELAXED))
+  {
+    got = ringread(&pb->buffer, out, frames);
+    if((got < frames && !__atomic_load_n(&pb->finished, __ATOMIC_ACQUIRE)) ||
+       (flags & paOutputUnderflow))
+      __atomic_add_fetch(&pb->underruns, 1, __ATOMIC_RELAXED);
+  }
+  memset(out+got*2, 0, (frames-got)*2*sizeof(float));
+  return paContinue;
+}
 
+void initaudio(playback* pb)
+{
+  pa_error = Pa_Initialize();
   if(pa_error != paNoError) portaudioerror(pa_error);
-  return channels;
+  PaStreamParameters out;
+  memset(&out, 0, sizeof(out));
+  out.device = Pa_GetDefaultOutputDevice();
+  if(out.device == paNoDevice) portaudioerror(paInvalidDevice);
+  out.channelCount = 2;
+  out.sampleFormat = paFloat32;
+  const PaDeviceInfo* info = Pa_GetDeviceInfo(out.device);
+  if(!strcmp(devicelatency, "low"))
+    out.suggestedLatency = info->defaultLowOutputLatency;
+  else if(!strcmp(devicelatency, "high"))
+    out.suggestedLatency = info->defaultHighOutputLatency;
+  else out.suggestedLatency = atof(devicelatency)/1000;
+  //open the audio stream
+  pa_error = Pa_OpenStream(&stream, NULL, &out, samplerate, blockframes,
+                           paNoFlag, audiocallback, pb);
+  if(pa_error != paNoError) portaudioerror(pa_error);
+  pb->outputlatency = Pa_GetStreamInfo(stream)->outputLatency;
 }
 
-void renderpattern(uint8_t* patterndata)
+//each channel takes 12 characters of a line
+void renderpattern(const modfile* m, int order)
 {
-  uint16_t period;
-  uint8_t tempsam;
-  uint8_t* data;
-  uint8_t tempeffect;
-  uint8_t effectdata;
+  const notetable* t = &m->notes;
+  int stride = 12*viewchannels;
 
   for(int line = 0; line < 64; line++)
   {
-    for(int chan = 0; chan < 4; chan++)
+    for(int chan = 0; chan < viewchannels; chan++)
     {
-      data = patterndata+16*line+chan*4;
-      period = (((uint16_t)((*data)&0x0F))<<8) | (uint16_t)(*(data+1));
-      tempsam = ((((*data))&0xF0) | ((*(data+2)>>4)&0x0F));
-      tempeffect = *(data+2)&0x0F;
-      effectdata = *(data+3);
+      char* cell = displaypatterns+stride*line+chan*12;
+      uint32_t n = rownote(m, order, line)+chan;
 
-      //tempsam = tempsam;
       //if(period) sprintf((displaypatterns+49*line+chan*12), "%03x ", period);
-      if(period)
-      {
-        char* notestr;
-        int8_t noteid = findperiod(period);
-        if(noteid == -1) notestr = "???";
-        else notestr = notes[noteid];
-        sprintf((displaypatterns+48*line+chan*12), "%s ", 
-          notestr);
-      }
-      else sprintf((displaypatterns+48*line+chan*12), "    ");
-      if(tempsam) sprintf((displaypatterns+48*line+chan*12+4),
-        "%2X ", tempsam);
-      else sprintf((displaypatterns+48*line+chan*12+4), "   ");
-      if(tempeffect || effectdata)
-        sprintf((displaypatterns+48*line+chan*12+7), "%03X| ",
-          ((uint16_t)tempeffect<<8)|effectdata);
-      else sprintf((displaypatterns+48*line+chan*12+7), "   | ");
+      if(t->period[n])
+        sprintf(cell, "%s ", t->note[n] == -1 ? "???" : notes[t->note[n]]);
+      else sprintf(cell, "    ");
+      if(t->sample[n]) sprintf(cell+4, "%2X ", t->sample[n]);
+      else sprintf(cell+4, "   ");
+      if(t->effect[n] || t->param[n])
+        sprintf(cell+7, "%03X| ", ((uint16_t)t->effect[n]<<8)|t->param[n]);
+      else sprintf(cell+7, "   | ");
     }
     //wprintw(patternwin, "%s\n", displaypatterns+line*49);
     //wrefresh(patternwin);
@@ -311,35 +1040,35 @@ void renderpattern(uint8_t* patterndata)
   return;
 }
 
-void preprocesseffects(uint8_t* data)
+void preprocesseffects(player* p, uint32_t n)
 {
-  if ((*(data+2)&0x0F) == 0x0F) //set speed/tempo
+  if (p->mod->notes.effect[n] == 0x0F) //set speed/tempo
   {
-    uint8_t effectdata = *(data+3);
+    uint8_t effectdata = p->mod->notes.param[n];
     //if(effectdata == 0) return;
     if(effectdata > 0x1F)
     {
-      gm->tempo = effectdata;
-      nexttempo = effectdata;
-      ticktime = 1/(0.4*effectdata);
-      nextticktime = 1/(0.4*effectdata);
+      p->mod->tempo = effectdata;
+      p->nexttempo = effectdata;
+      p->ticktime = 1/(0.4*effectdata);
+      p->nextticktime = 1/(0.4*effectdata);
     }
     else
     {
-      gm->speed = effectdata;
-      nextspeed = effectdata;
+      p->mod->speed = effectdata;
+      p->nextspeed = effectdata;
     }
   }
 }
 
-void processnoteeffects(channel* c, uint8_t* data)
+void processnoteeffects(player* p, channel* c, uint32_t n)
 {
-  uint8_t tempeffect = *(data+2)&0x0F;
-  uint8_t effectdata = *(data+3);
+  uint8_t tempeffect = p->mod->notes.effect[n];
+  uint8_t effectdata = p->mod->notes.param[n];
   switch(tempeffect)
   {
     case 0x00: //normal/arpeggio
-      if(effectdata) c->tempperiod = c->arp[globaltick%3];
+      if(effectdata) c->tempperiod = c->arp[p->globaltick%3];
       break;
 
     case 0x01: //slide up
@@ -358,7 +1087,7 @@ void processnoteeffects(channel* c, uint8_t* data)
       //slide down
       else c->volume -= effectdata;
       c->tempvolume = c->volume;
-      //exploit fallthrough
+      //fall through
 
     case 0x03: //tone portamento
       if(abs(c->portdest - c->period) < c->portstep)
@@ -376,7 +1105,7 @@ void processnoteeffects(channel* c, uint8_t* data)
       //slide down
       else c->volume -= effectdata;
       c->tempvolume = c->volume;
-      //exploit fallthrough
+      //fall through
 
     case 0x04: //vibrato
       c->tempperiod = c->period +
@@ -432,11 +1161,15 @@ void processnoteeffects(channel* c, uint8_t* data)
 
         case 0x90: //retrigger note + x vblanks (ticks)
           if(((effectdata&0x0F) == 0) ||
-            (globaltick % (effectdata&0x0F)) == 0) c->index = c->offset;
+            (p->globaltick % (effectdata&0x0F)) == 0)
+          {
+            c->index = c->offset;
+            c->error = 0;
+          }
           break;
 
         case 0xC0: //cut from note + x vblanks
-          if(globaltick == (effectdata&0x0F)) c->volume = 0;
+          if(p->globaltick == (effectdata&0x0F)) c->volume = 0;
           break;
       }
       break;
@@ -444,15 +1177,15 @@ void processnoteeffects(channel* c, uint8_t* data)
     case 0x0F:
       if(effectdata == 0)
       {
-        done = true;
+        p->done = true;
         break;
       }
       if(effectdata > 0x1F)
       {
-        nexttempo = effectdata;
-        nextticktime = 1/(0.4*effectdata);
+        p->nexttempo = effectdata;
+        p->nextticktime = 1/(0.4*effectdata);
       }
-      else nextspeed = effectdata;
+      else p->nextspeed = effectdata;
       break;
 
     default:
@@ -460,59 +1193,447 @@ void processnoteeffects(channel* c, uint8_t* data)
   }
 }
 
-void processnote(channel* c, uint8_t* data, uint8_t offset,
-                 bool overwrite)
+//give a sample its own copy of its data before anything writes to it
+void unsharesample(sample* s)
+{
+  if(s->owned) return;
+  int8_t* copy = malloc(s->length*2);
+  memcpy(copy, s->sampledata, s->length*2);
+  s->sampledata = copy;
+  s->owned = true;
+}
+
+//sampledata position that frame j of the loop copy holds, for j from
+//-SAMPLE_PAD to looplen+SAMPLE_PAD, so its padding wraps round the loop
+uint32_t loopsource(sample* s, int j)
+{
+  int looplen = s->repeatlength*2;
+  return s->repeatpoint*2 + ((j%looplen)+looplen)%looplen;
+}
+
+//what the kth frame of padding after the sample end copies: the start of
+//the loop, or the last frame held for a one shot sample
+uint32_t padsource(sample* s, int k)
+{
+  if(s->repeatlength > 1) return loopsource(s, k);
+  return s->length*2-1;
+}
+
+//sets frame k of the store, or of the loop copy, in whichever format
+//the engine reads
+static inline void putstore(sample* s, bool loop, int k, int8_t v)
+{
+  if(fixedpoint) (loop ? s->loopstore8 : s->store8)[k] = v;
+  else (loop ? s->loopstore : s->store)[k] = v;
+}
+
+//converts the sample once at load, laid out as described in sample
+void buildstore(sample* s)
+{
+  uint32_t len = s->length*2;
+  uint32_t looplen = s->repeatlength*2;
+  bool looped = s->repeatlength > 1;
+  size_t frames = len+2*SAMPLE_PAD + (looped ? looplen+2*SAMPLE_PAD : 0);
+  void* block;
+  if(posix_memalign(&block, 32, frames*(fixedpoint ? 1 : sizeof(float))))
+    abort();
+  if(fixedpoint) s->store8 = (int8_t*)block+SAMPLE_PAD;
+  else s->store = (float*)block+SAMPLE_PAD;
+  for(int k = 1; k <= SAMPLE_PAD; k++) putstore(s, false, -k, 0);
+  for(uint32_t i = 0; i < len; i++) putstore(s, false, i, s->sampledata[i]);
+  for(int k = 0; k < SAMPLE_PAD; k++)
+    putstore(s, false, len+k, s->sampledata[padsource(s, k)]);
+  if(!looped) return;
+  if(fixedpoint) s->loopstore8 = s->store8+len+2*SAMPLE_PAD;
+  else s->loopstore = s->store+len+2*SAMPLE_PAD;
+  for(int j = -SAMPLE_PAD; j < (int)looplen+SAMPLE_PAD; j++)
+    putstore(s, true, j, s->sampledata[loopsource(s, j)]);
+}
+
+//carries a write to sampledata at pos into the store, the loop copy and
+//any padding that mirrors it
+void updatestore(sample* s, uint32_t pos)
+{
+  int8_t v = s->sampledata[pos];
+  uint32_t len = s->length*2;
+  putstore(s, false, pos, v);
+  for(int k = 0; k < SAMPLE_PAD; k++)
+    if(padsource(s, k) == pos) putstore(s, false, len+k, v);
+  uint32_t loopstart = s->repeatpoint*2;
+  int looplen = s->repeatlength*2;
+  if((s->loopstore == NULL && s->loopstore8 == NULL) ||
+     pos < loopstart || pos >= loopstart+looplen)
+    return;
+  putstore(s, true, pos-loopstart, v);
+  for(int k = 0; k < SAMPLE_PAD; k++)
+  {
+    if(loopsource(s, -1-k) == pos) putstore(s, true, -1-k, v);
+    if(loopsource(s, looplen+k) == pos) putstore(s, true, looplen+k, v);
+  }
+}
+
+//invert is false when only the sequencer runs, so the sample isn't touched
+void funkrepeat(channel* c, bool invert)
 {
-  uint8_t tempeffect = *(data+2)&0x0F;
-  uint8_t effectdata = *(data+3);
-  if(globaltick == 0 && tempeffect == 0x0E && (effectdata&0xF0) == 0xD0)
-      c->deltick = (effectdata&0x0F)%gm->speed;
-  if(globaltick == c->deltick)
+  if(c->sample->repeatlength == 0) return;
+  c->funkcounter += c->funkspeed;
+  if(c->funkcounter >= 128)
   {
-    uint16_t period = (((uint16_t)((*data)&0x0F))<<8) | (uint16_t)(*(data+1));
-    uint8_t tempsam = ((((*data))&0xF0) | ((*(data+2)>>4)&0x0F));
-    //if(period) printw("%03x", period);
-    //else printw("   ");
-    if((period || tempsam) && !inrepeat)
+    c->funkcounter = 0;
+    //funkpos may still be counting through a longer loop of another sample,
+    //don't let it run off the end of this one
+    if(c->sample->repeatpoint*2+c->funkpos >= c->sample->length*2)
+      c->funkpos = 0;
+    if(invert)
     {
-      if(tempsam)
+      uint32_t pos = c->sample->repeatpoint*2+c->funkpos;
+      unsharesample(c->sample);
+      c->sample->sampledata[pos] ^= 0xFF;
+      updatestore(c->sample, pos);
+    }
+    c->funkpos = (c->funkpos+1) % (c->sample->repeatlength*2);
+  }
+}
+
+//sample frames a channel plays this tick at rate, carrying the fraction so
+//libsamplerate is fed exactly what the output uses up over time
+int sourceframes(player* p, channel* c, double rate)
+{
+  double exact = p->tickframes*rate/samplerate + c->sourcecarry;
+  int n = exact;
+  c->sourcecarry = exact-n;
+  return n;
+}
+
+//libsamplerate path: n samples from the channel into out as float, wrapping
+//loops as it goes; with out NULL the position just moves on
+void expandsample(channel* c, int n, float gain, float* out)
+{
+  sample* s = c->sample;
+  //copy whole runs up to the next loop end or sample end at a time
+  for(int i = 0; i < n;)
+  {
+    //wrap before reading so a 9xx offset past the end is never read
+    if(c->repeat && (c->index >= (s->repeatlength)*2
+      + (s->repeatpoint)*2))
+    {
+      c->index = s->repeatpoint*2;
+    }
+    else if(c->index >= (s->length)*2)
+    {
+      if(s->repeatlength > 1)
       {
-        /*if (c->sample != gm->samples[tempsam])
-        {
-          c->funkpos = 0;
-        }*/
-        //printw("%2x ", tempsam);
-        c->error = 0;
-        c->stop = false;
-        tempsam--;
-        if(tempeffect != 0x03 && tempeffect != 0x05) c->offset = 0;
-        //sample* prevsam = c->sample;
-        c->sample = gm->samples[tempsam];
-        c->volume = c->sample->volume;
-        c->tempvolume = c->volume;
+        c->index = s->repeatpoint*2;
+        c->repeat = true;
       }
-      //else printw("00 ");
-      //printw("FINETUNE: %f\n", (double)(c->sample->finetune));
-      if(period)
+      else
       {
-        if(tempeffect != 0x03 && tempeffect != 0x05)
-        {
-          if(tempeffect == 0x09)
-          {
-            if(effectdata) c->offsetmem = effectdata * 0x100;
-            c->offset += c->offsetmem;
-          }
-          c->period = period;
-          c->tempperiod = period;
-          c->index = c->offset;
-          c->stop = false;
-          c->repeat = false;
-          c->vibpos = 0;
-          c->trempos = 0;
-          c->error = 0;
-        }
-        c->portdest = period;
-        //c->arp[0] = c->period;
+        if(out)
+          for(int j = i; j < n; j++) out[j] = 0;
+        c->stop = true;
+        break;
+      }
+      //c->index = restore;
+    }
+    uint32_t end = c->repeat ? (s->repeatpoint+s->repeatlength)*2
+                             : s->length*2;
+    int run = end-c->index < (uint32_t)(n-i) ? (int)(end-c->index) : n-i;
+    if(out) convert(out+i, s->sampledata+c->index, run, gain);
+    c->index += run;
+    i += run;
+  }
+}
+
+//adds one channel's frames into both lanes of audiobuf, skipping a silent lane
+void mixpanned(player* p, channel* c, const float* in, int frames, float gain)
+{
+  if(c->pan[0] != 0.0f) mixlane(p->audiobuf, in, frames, gain*c->pan[0]);
+  if(c->pan[1] != 0.0f) mixlane(p->audiobuf+1, in, frames, gain*c->pan[1]);
+}
+
+/*n frames from data at the 16.16 position index.error with the selected
+  interpolator, moving the position on. Rough cost per voice and output
+  frame, relative to linear: nearest 0.8x, cubic 2x, sinc 3.5x*/
+void interpolaterun(const float* data, uint32_t* index, uint32_t* error,
+                    uint32_t increment, float* out, int n)
+{
+  uint32_t i = *index;
+  uint32_t e = *error;
+  switch(interp)
+  {
+    case INTERP_NEAREST:
+      for(int k = 0; k < n; k++)
+      {
+        out[k] = data[i];
+        e += increment;
+        i += e>>16;
+        e &= 0xFFFF;
+      }
+      break;
+    case INTERP_LINEAR:
+      for(int k = 0; k < n; k++)
+      {
+        float cur = data[i];
+        out[k] = cur + (data[i+1]-cur)*(e*(1.0f/65536.0f));
+        e += increment;
+        i += e>>16;
+        e &= 0xFFFF;
+      }
+      break;
+    case INTERP_CUBIC: //Catmull-Rom through the two frames either side
+      for(int k = 0; k < n; k++)
+      {
+        const float* d = data+i;
+        float t = e*(1.0f/65536.0f);
+        out[k] = d[0] + 0.5f*t*(d[1]-d[-1] + t*(2*d[-1]-5*d[0]+4*d[1]-d[2] +
+          t*(3*(d[0]-d[1])+d[2]-d[-1])));
+        e += increment;
+        i += e>>16;
+        e &= 0xFFFF;
+      }
+      break;
+    default:
+      for(int k = 0; k < n; k++)
+      {
+        const float* d = data+i-(SINC_TAPS/2-1);
+        const float* taps = sinctable[e*SINC_PHASES>>16];
+        float sum = 0;
+        for(int j = 0; j < SINC_TAPS; j++) sum += d[j]*taps[j];
+        out[k] = sum;
+        e += increment;
+        i += e>>16;
+        e &= 0xFFFF;
+      }
+      break;
+  }
+  *index = i;
+  *error = e;
+}
+
+/*fixed point engine, for CPUs with slow or no floating point. Samples stay
+  int8 and step with the same 16.16 phase, linear interpolation rounds to
+  Q8 samples, and each lane's gain is the
+  6 bit volume times the channel's pan. Sums go into the int32 bus, which is
+  the int16 output with FIXED_SHIFT more bits, so there is room for 32 full
+  scale channels and the filters' overshoot*/
+void interpolatefixed(const int8_t* data, uint32_t* index, uint32_t* error,
+                      uint32_t increment, int16_t* out, int n)
+{
+  uint32_t i = *index;
+  uint32_t e = *error;
+  if(interp == INTERP_NEAREST)
+  {
+    for(int k = 0; k < n; k++)
+    {
+      out[k] = data[i]*256;
+      e += increment;
+      i += e>>16;
+      e &= 0xFFFF;
+    }
+  }
+  else
+  {
+    for(int k = 0; k < n; k++)
+    {
+      int cur = data[i];
+      out[k] = cur*256 + (((data[i+1]-cur)*(int32_t)e)>>8);
+      e += increment;
+      i += e>>16;
+      e &= 0xFFFF;
+    }
+  }
+  *index = i;
+  *error = e;
+}
+
+void mixlanefixed(int32_t* out, const int16_t* in, int frames, int32_t gain)
+{
+  for(int i = 0; i < frames; i++) out[i*2] += in[i]*gain;
+}
+
+/*ipan is pan*0.4*32767/2, so with the volume's /64 a Q8 sample times the
+  gain lands FIXED_SHIFT bits above the float path's int16 output. At full
+  volume a channel's gain is at most 6554, its sum at most 2^28*/
+void mixpannedfixed(player* p, channel* c, const int16_t* in, int frames)
+{
+  for(int lane = 0; lane < 2; lane++)
+  {
+    int32_t gain = (c->tempvolume*c->ipan[lane]+32)>>6;
+    if(gain) mixlanefixed(p->fixedbus+lane, in, frames, gain);
+  }
+}
+
+/*built in resampler: steps through the sample store with a 16.16 fixed
+  point phase accumulator, reading between frames with the --interp tier
+  (nearest, linear, cubic or sinc), then hands the frames to mixpanned(), or
+  mixpannedfixed() with --fixed, for the stereo output. The padding lets
+  each run up to the next loop wrap go without checking the ends*/
+void mixchannel(player* p, channel* c, int frames)
+{
+  float* mono = p->channelbuf;
+  int i = 0;
+  if(!c->stop)
+  {
+    sample* s = c->sample;
+    funkrepeat(c, true);
+    uint32_t loopstart = s->repeatpoint*2;
+    uint32_t looplen = s->repeatlength*2;
+    bool looped = s->repeatlength > 1;
+    uint32_t end = c->repeat ? loopstart+looplen : s->length*2;
+    bool haveloop = s->loopstore || s->loopstore8;
+
+    c->increment = calcstep(c->tempperiod, s->finetune);
+
+    double start = profilestart(p);
+    while(i < frames)
+    {
+      if(c->index >= end)
+      {
+        if(!looped)
+        {
+          c->stop = true;
+          break;
+        }
+        //keep the overshoot so the phase stays continuous across the wrap
+        uint32_t over = c->index-end;
+        c->index = loopstart + (over < looplen ? over : 0);
+        c->repeat = true;
+        end = loopstart+looplen;
+      }
+      //a sample swapped in without a note can leave the index before the
+      //loop, so play up to the loop start from the full store first
+      bool inloop = c->repeat && haveloop && c->index >= loopstart;
+      uint32_t stop = c->repeat && !inloop && haveloop ? loopstart : end;
+      //frames until the index reaches stop, as in advancechannel()
+      uint64_t need = ((uint64_t)(stop-c->index)<<16) - c->error;
+      uint64_t run = (need+c->increment-1)/c->increment;
+      if(run > (uint64_t)(frames-i)) run = frames-i;
+      uint32_t index = c->index - (inloop ? loopstart : 0);
+      uint32_t error = c->error;
+      if(fixedpoint)
+        interpolatefixed(inloop ? s->loopstore8 : s->store8, &index, &error,
+          c->increment, p->fixedbuf+i, run);
+      else
+        interpolaterun(inloop ? s->loopstore : s->store, &index, &error,
+          c->increment, mono+i, run);
+      i += run;
+      c->index = index + (inloop ? loopstart : 0);
+      c->error = error;
+    }
+    profileend(p, STAGE_RESAMPLE, start);
+    start = profilestart(p);
+    if(fixedpoint) mixpannedfixed(p, c, p->fixedbuf, i);
+    else mixpanned(p, c, mono, i, c->tempvolume/64.0f*0.4f/128.0f);
+    profileend(p, STAGE_MIX, start);
+  }
+}
+
+/*moves a channel on by one tick without making any audio, for the seek
+  index. Ends up exactly where mixchannel() or the libsamplerate path would,
+  jumping from one loop wrap to the next instead of stepping every frame*/
+void advancechannel(player* p, channel* c, int frames)
+{
+  if(c->stop) return;
+  sample* s = c->sample;
+  funkrepeat(c, false);
+  if(uselibsrc)
+  {
+    double rate = calcrate(c->tempperiod, s->finetune);
+    expandsample(c, sourceframes(p, c, rate), 0, NULL);
+    return;
+  }
+  uint32_t loopstart = s->repeatpoint*2;
+  uint32_t looplen = s->repeatlength*2;
+  bool looped = s->repeatlength > 1;
+  uint32_t end = c->repeat ? loopstart+looplen : s->length*2;
+  c->increment = calcstep(c->tempperiod, s->finetune);
+  while(frames > 0)
+  {
+    if(c->index >= end)
+    {
+      if(!looped)
+      {
+        c->stop = true;
+        return;
+      }
+      uint32_t over = c->index-end;
+      c->index = loopstart + (over < looplen ? over : 0);
+      c->repeat = true;
+      end = loopstart+looplen;
+    }
+    //frames until the index reaches end, where the mixer would wrap
+    uint64_t need = ((uint64_t)(end-c->index)<<16) - c->error;
+    uint64_t step = (need+c->increment-1)/c->increment;
+    if(step > (uint64_t)frames) step = frames;
+    uint64_t phase = c->error + c->increment*step;
+    c->index += phase>>16;
+    c->error = phase&0xFFFF;
+    frames -= step;
+  }
+}
+
+//E0x, resetting the LED filter's memory as it comes back in
+void setled(player* p, bool on)
+{
+  if(on && !p->led) memset(&p->ledstate, 0, sizeof(biquadstate));
+  p->led = on;
+}
+
+//n is the channel's note in the notetable
+void processnote(player* p, channel* c, uint32_t n)
+{
+  const notetable* t = &p->mod->notes;
+  uint8_t tempeffect = t->effect[n];
+  uint8_t effectdata = t->param[n];
+  if(p->globaltick == 0 && tempeffect == 0x0E && (effectdata&0xF0) == 0xD0)
+      c->deltick = (effectdata&0x0F)%p->mod->speed;
+  if(p->globaltick == c->deltick)
+  {
+    uint16_t period = t->period[n];
+    uint8_t tempsam = t->sample[n];
+    //if(period) printw("%03x", period);
+    //else printw("   ");
+    if((period || tempsam) && !p->inrepeat)
+    {
+      if(tempsam)
+      {
+        /*if (c->sample != p->mod->samples[tempsam])
+        {
+          c->funkpos = 0;
+        }*/
+        //printw("%2x ", tempsam);
+        c->error = 0;
+        c->stop = false;
+        tempsam--;
+        if(tempeffect != 0x03 && tempeffect != 0x05) c->offset = 0;
+        //sample* prevsam = c->sample;
+        c->sample = p->mod->samples[tempsam];
+        c->volume = c->sample->volume;
+        c->tempvolume = c->volume;
+      }
+      //else printw("00 ");
+      //printw("FINETUNE: %f\n", (double)(c->sample->finetune));
+      if(period)
+      {
+        if(tempeffect != 0x03 && tempeffect != 0x05)
+        {
+          if(tempeffect == 0x09)
+          {
+            if(effectdata) c->offsetmem = effectdata * 0x100;
+            c->offset += c->offsetmem;
+          }
+          c->period = period;
+          c->tempperiod = period;
+          c->index = c->offset;
+          c->stop = false;
+          c->repeat = false;
+          c->vibpos = 0;
+          c->trempos = 0;
+          c->error = 0;
+        }
+        c->portdest = period;
+        c->portnote = t->note[n];
+        //c->arp[0] = c->period;
       }
     }
     //if(tempeffect || effectdata) printw("%1x %02x ", tempeffect, effectdata);
@@ -523,7 +1644,7 @@ void processnote(channel* c, uint8_t* data, uint8_t offset,
         if(effectdata)
         {
           c->period = c->portdest;
-          int base = findperiod(c->period);
+          int base = c->portnote;
           if(base == -1)
           {
             c->arp[0] = c->period;
@@ -567,9 +1688,9 @@ void processnote(channel* c, uint8_t* data, uint8_t offset,
         break;
 
       case 0x0B: //position jump
-        if(currow == row) row = 0;
-        pattern = effectdata;
-        patternset = true;
+        if(p->currow == p->row) p->row = 0;
+        p->pattern = effectdata;
+        p->patternset = true;
         break;
 
       case 0x0C: //set volume
@@ -579,19 +1700,23 @@ void processnote(channel* c, uint8_t* data, uint8_t offset,
         break;
 
       case 0x0D: //row jump
-        if(delcount) break;
-        if(!patternset)
-          pattern++;
-        if(pattern >= gm->songlength) pattern = 0;
-        row = (effectdata>>4)*10+(effectdata&0x0F);
-        patternset = true;
-        if(addflag) row++; //emulate protracker EEx + Dxx bug
+        if(p->delcount) break;
+        if(!p->patternset)
+          p->pattern++;
+        if(p->pattern >= p->mod->songlength) p->pattern = 0;
+        p->row = (effectdata>>4)*10+(effectdata&0x0F);
+        p->patternset = true;
+        if(p->addflag) p->row++; //emulate protracker EEx + Dxx bug
         break;
 
       case 0x0E:
       {
         switch(effectdata&0xF0)
         {
+          case 0x00: //LED filter, E00 on and E01 off
+            setled(p, !(effectdata&0x01));
+            break;
+
           case 0x10:
             c->period -= effectdata&0x0F;
             c->tempperiod = c->period;
@@ -603,15 +1728,15 @@ void processnote(channel* c, uint8_t* data, uint8_t offset,
             break;
 
           case 0x60: //jump to loop, play x times
-            if(!(effectdata & 0x0F)) c->looppoint = row;
+            if(!(effectdata & 0x0F)) c->looppoint = p->row;
             else if(effectdata & 0x0F)
             {
               if(c->loopcount == -1)
               {
                 c->loopcount = (effectdata & 0x0F);
-                row = c->looppoint;
+                p->row = c->looppoint;
               }
-              else if(c->loopcount) row = c->looppoint;
+              else if(c->loopcount) p->row = c->looppoint;
               c->loopcount--;
             }
             break;
@@ -631,11 +1756,11 @@ void processnote(channel* c, uint8_t* data, uint8_t offset,
             break;
 
           case 0xE0: //delay pattern x notes
-            if(!delset) delcount = effectdata&0x0F;
-            delset = true;
+            if(!p->delset) p->delcount = effectdata&0x0F;
+            p->delset = true;
             /*emulate bug that causes protracker to cause Dxx to jump
             too far when used in conjunction with EEx*/
-            addflag = true;
+            p->addflag = true;
             break;
 
           case 0xF0:
@@ -654,19 +1779,21 @@ void processnote(channel* c, uint8_t* data, uint8_t offset,
     if(c->tempperiod == 0 || c->sample == NULL || c->sample->length == 0)
       c->stop = true;
   }
-  else if (c->deltick == 0) processnoteeffects(c, data);
-  if(c->retrig && globaltick == c->retrig-1)
+  else if (c->deltick == 0) processnoteeffects(p, c, n);
+  if(c->retrig && p->globaltick == c->retrig-1)
   {
     c->index = 0;
+    c->error = 0;
     c->stop = false;
     c->repeat = false;
   }
 
   double conv_ratio;
+  int libsrc_error;
 
   //RESAMPLE PER TICK
 
-  int writesize = SAMPLE_RATE*ticktime;
+  int writesize = p->tickframes;
   if(c->volume < 0) c->volume = 0;
   else if(c->volume > 64) c->volume = 64;
 
@@ -675,72 +1802,57 @@ void processnote(channel* c, uint8_t* data, uint8_t offset,
   if(c->tempperiod > 856) c->tempperiod = 856;
   else if(c->tempperiod < 113) c->tempperiod = 113;
 
+  if(p->silent || !uselibsrc)
+  {
+    if(p->silent) advancechannel(p, c, writesize);
+    else mixchannel(p, c, writesize);
+    if(p->globaltick == p->mod->speed - 1)
+    {
+      c->tempperiod = c->period;
+      c->deltick = 0;
+    }
+    return;
+  }
+
   //write empty frame
-  c->cdata->output_frames = ticktime*SAMPLE_RATE;
+  c->cdata->output_frames = writesize;
   if(c->stop)
   {
     conv_ratio = 1.0;
     c->cdata->src_ratio = conv_ratio;
     libsrc_error = src_set_ratio(c->converter, conv_ratio);
     if(libsrc_error) libsrcerror(libsrc_error);
-    c->cdata->input_frames = ticktime*SAMPLE_RATE;
-    //c->rate = SAMPLE_RATE;
-    for(int i = 0; i < ticktime*SAMPLE_RATE; i++)
+    c->cdata->input_frames = writesize;
+    //c->rate = samplerate;
+    for(int i = 0; i < writesize; i++)
       c->buffer[i] = 0.0f;
   }
   //write non-empty frame to buffer to be interpolated
   else
   {
     double rate = calcrate(c->tempperiod, c->sample->finetune);
-    conv_ratio = SAMPLE_RATE/rate;
+    conv_ratio = samplerate/rate;
     c->cdata->src_ratio = conv_ratio;
     libsrc_error = src_set_ratio(c->converter, conv_ratio);
     if(libsrc_error) libsrcerror(libsrc_error);
-    c->cdata->input_frames = ticktime*rate;
-
-    c->funkcounter += c->funkspeed;
-    if(c->funkcounter >= 128)
-    {
-      c->funkcounter = 0;
-      c->sample->sampledata[c->sample->repeatpoint*2+c->funkpos] ^= 0xFF;
-      c->funkpos = (c->funkpos+1) % (c->sample->repeatlength*2);
-    }
+    int n = sourceframes(p, c, rate);
+    c->cdata->input_frames = n;
 
-    for(int i = 0; i < ticktime*rate-1; i++)
-    {
-      c->buffer[i] = (float)c->sample->sampledata[c->index++]/128.0f
-        * c->tempvolume/64.0 * 0.4f;
+    funkrepeat(c, true);
 
-      if(c->repeat && (c->index >= (c->sample->repeatlength)*2
-        + (c->sample->repeatpoint)*2))
-      {
-        c->index = c->sample->repeatpoint*2;
-      }
-      else if(c->index >= (c->sample->length)*2)
-      {
-        if(c->sample->repeatlength > 1)
-        {
-          c->index = c->sample->repeatpoint*2;
-          c->repeat = true;
-        }
-        else
-        {
-          //float last = c->buffer[i];
-          for(int j = i+1; j < ticktime*rate-1; j++)
-            c->buffer[j] = 0;
-          c->stop = true;
-          break;
-        }
-        //c->index = restore;
-      }
-    }
+    float gain = c->tempvolume/64.0f*0.4f/128.0f;
+    double start = profilestart(p);
+    expandsample(c, n, gain, c->buffer);
+    profileend(p, STAGE_EXPAND, start);
     //add fractional part of rate calculation to account for error
-    /*c->error += rate*ticktime - (uint32_t)(rate*ticktime);
+    /*c->error += rate*p->ticktime - (uint32_t)(rate*p->ticktime);
     c->index += c->error;
     c->error -= (uint32_t)(c->error);*/
   }
+  double start = profilestart(p);
   libsrc_error = src_process(c->converter, c->cdata);
   if(libsrc_error) libsrcerror(libsrc_error);
+  profileend(p, STAGE_RESAMPLE, start);
 
   if(c->cdata->output_frames_gen != c->cdata->output_frames)
   {
@@ -752,22 +1864,11 @@ void processnote(channel* c, uint8_t* data, uint8_t offset,
   }
 
   //WRITE TO MIXING BUFFER
-  if(overwrite)
-  {
-    for(int i = 0; i < writesize; i++)
-    {
-      audiobuf[i*2+offset] = c->resampled[i];
-    }
-  }
-  else
-  {
-    for(int i = 0; i < writesize; i++)
-    {
-      audiobuf[i*2+offset] += c->resampled[i];
-    }
-  }
+  start = profilestart(p);
+  mixpanned(p, c, c->resampled, writesize, 1.0f);
+  profileend(p, STAGE_MIX, start);
 
-  if(globaltick == gm->speed - 1)
+  if(p->globaltick == p->mod->speed - 1)
   {
     c->tempperiod = c->period;
     //c->tempvolume = c->volume;
@@ -775,13 +1876,20 @@ void processnote(channel* c, uint8_t* data, uint8_t offset,
   }
 }
 
-void sampleparse(modfile* m, uint8_t* filearr, uint32_t start)
+bool sampleparse(modfile* m, const uint8_t* filearr, uint32_t start,
+                 size_t filelength)
 {
 
-  for(int i = 0; i < numsamples; i++)
+  for(int i = 0; i < m->numsamples; i++)
   {
     sample* s = malloc(sizeof(sample));
     m->samples[i] = s;
+    s->sampledata = NULL;
+    s->owned = false;
+    s->store = NULL;
+    s->loopstore = NULL;
+    s->store8 = NULL;
+    s->loopstore8 = NULL;
     strncpy(s->name, (char*)filearr+20+(30*i), 22);
     s->name[22] = '\x00';
 
@@ -794,12 +1902,6 @@ void sampleparse(modfile* m, uint8_t* filearr, uint32_t start)
       if(s->name[j] < 32) s->name[j] = 32;
     }
 
-    if(i+5 < LINES)
-    {
-      if(s->name[0]) mvprintw(i+5, 52, "%02X %s", i+1, s->name);
-      else mvprintw(i+5, 52, "%02X", i+1);
-    }
-
     //printw("length: %d\n", s->length);
     if (s->length != 0)
     {
@@ -814,140 +1916,267 @@ void sampleparse(modfile* m, uint8_t* filearr, uint32_t start)
       s->repeatlength = (uint16_t)*(filearr+48+(30*i)) << 8;
       s->repeatlength |= (uint16_t)*(filearr+49+(30*i));
 
-      int copylen = (s->length)*2;
-      //s->sampledata = malloc(copylen*sizeof(float));
-      s->sampledata = malloc(copylen*sizeof(int8_t));
+      //keep loops inside the sample so the mixer never reads past it
+      if(s->repeatpoint >= s->length)
+      {
+        s->repeatpoint = 0;
+        s->repeatlength = 1;
+      }
+      else if(s->repeatpoint + s->repeatlength > s->length)
+        s->repeatlength = s->length - s->repeatpoint;
 
-      if ((start + copylen) > filelength) abort();
-      //floatncpy(s->sampledata, (int8_t*)(filearr+start), copylen);
-      memcpy(s->sampledata, (int8_t*)(filearr+start), copylen);
+      int copylen = (s->length)*2;
+      if ((start + copylen) > filelength) return false;
+      //shared with the file image, copied on write by unsharesample
+      s->sampledata = (int8_t*)(filearr+start);
       start += copylen;
+      buildstore(s);
     }
   }
-  return;
+  return true;
+}
+
+uint64_t gcd(uint64_t a, uint64_t b)
+{
+  while(b)
+  {
+    uint64_t t = a%b;
+    a = b;
+    b = t;
+  }
+  return a;
 }
 
-void steptick(channel* cp)
+void steptick(player* p)
 {
-  if(row == 64)
+  if(p->row == 64)
   {
-    row = 0;
-    if(pattern == curpattern) pattern++;
-    /*if(pattern < gm->songlength)
-      renderpattern(gm->patterns + 1024*gm->patternlist[pattern]);*/
+    p->row = 0;
+    if(p->pattern == p->curpattern) p->pattern++;
+    /*if(p->pattern < p->mod->songlength)
+      renderpattern(p->mod->patterns + 1024*p->mod->patternlist[p->pattern]);*/
   }
-  if(pattern >= gm->songlength)
+  if(p->pattern >= p->mod->songlength)
   {
-    if(loop)
+    if(p->loop)
     {
-      pattern = 0;
-      row = 0;
-      globaltick = 0;
-      gm->speed = 6;
-      nextspeed = 6;
-      gm->tempo = 125;
-      nexttempo = 125;
-      ticktime = 0.02;
-      nextticktime = 0.02;
-      /*renderpattern(gm->patterns + 1024*gm->patternlist[pattern]);*/
+      p->pattern = 0;
+      p->row = 0;
+      p->globaltick = 0;
+      p->mod->speed = 6;
+      p->nextspeed = 6;
+      p->mod->tempo = 125;
+      p->nexttempo = 125;
+      p->ticktime = 0.02;
+      p->nextticktime = 0.02;
+      p->frame = 0;
+      /*renderpattern(p->mod->patterns + 1024*p->mod->patternlist[p->pattern]);*/
     }
     else
     {
-      done = true;
+      p->done = true;
       return;
     }
   }
 
-  if(globaltick == 0)
+  if(p->globaltick == 0 && p->stopatloop)
   {
-    attron(COLOR_PAIR(3));
-    mvprintw(4, 0, "position: 0x%02X  pattern: 0x%02X  row: 0x%02X  speed: 0x%02X  tempo: %d\n",
-      pattern, gm->patternlist[pattern], row, gm->speed, gm->tempo);
-    if(pattern != curpattern)
-      renderpattern(gm->patterns + 1024*gm->patternlist[pattern]);
-    for(int line = -6; line < 12; line++)
+    //a jump back to an order already played means the song has looped
+    if((p->pattern != p->curpattern || p->patternset) && p->visited[p->pattern])
     {
-      if(line == 0)
-      {
-        wattron(patternwin, A_REVERSE);
-        mvwprintw(patternwin, 7+line, 1, " %s", displaypatterns+(row+line)*48);
-        wattroff(patternwin, A_REVERSE);
-      }
-      else if(row+line < 64 && row+line >= 0)
-        mvwprintw(patternwin, 7+line, 1, " %s", displaypatterns+(row+line)*48);
-      else
-        mvwaddstr(patternwin, 7+line, 1, "           |           |           |           ");
+      p->done = true;
+      return;
     }
-    box(patternwin, 0, 0);
-    wrefresh(patternwin);
-    refresh();
+    p->visited[p->pattern] = true;
+  }
 
-    patternset = false;
-    curdata = gm->patterns + ((gm->patternlist[pattern])*1024) + (16*row);
-    currow = row;
-    curpattern = pattern;
-    preprocesseffects(curdata);
-    preprocesseffects(curdata + 4);
-    preprocesseffects(curdata + 8);
-    preprocesseffects(curdata + 12);
-    gm->speed = nextspeed;
-    gm->tempo = nexttempo;
-    ticktime = nextticktime;
-    attroff(COLOR_PAIR(3));
+  if(p->globaltick == 0)
+  {
+    p->patternset = false;
+    p->curnote = rownote(p->mod, p->pattern, p->row);
+    p->currow = p->row;
+    p->curpattern = p->pattern;
+    for(int i = 0; i < p->mod->numchannels; i++)
+      preprocesseffects(p, p->curnote + i);
+    p->mod->speed = p->nextspeed;
+    p->mod->tempo = p->nexttempo;
+    p->ticktime = p->nextticktime;
   }
 
 
-  processnote(&cp[0], curdata, 0, true);
-  processnote(&cp[1], curdata + 4, 1, true);
-  processnote(&cp[2], curdata + 8, 1, false);
-  processnote(&cp[3], curdata + 12, 0, false);
+  /*whole frames only, carrying the rest so the song keeps exact time at any
+    rate. A tick is 5*rate/(2*BPM) frames, so the remainder is kept exactly
+    over the lcm of 2*BPM for every tempo the song has used, which only
+    ever grows by a whole factor. Past MAX_CARRYUNIT, a song with dozens of
+    tempos, it starts over from the new tempo, rounding the carry*/
+  uint64_t unit = 2*lround(2.5/p->ticktime);
+  if(p->carryunit == 0) p->carryunit = unit;
+  else if(p->carryunit%unit)
+  {
+    uint64_t lcm = p->carryunit/gcd(p->carryunit, unit)*unit;
+    if(lcm <= MAX_CARRYUNIT)
+    {
+      p->framecarry *= lcm/p->carryunit;
+      p->carryunit = lcm;
+    }
+    else
+    {
+      p->framecarry = (p->framecarry*unit+p->carryunit/2)/p->carryunit;
+      p->carryunit = unit;
+    }
+  }
+  uint64_t exact = (uint64_t)samplerate*5*(p->carryunit/unit) + p->framecarry;
+  int frames = exact/p->carryunit;
+  p->framecarry = exact%p->carryunit;
+  p->tickframes = frames;
+  if(!p->silent && fixedpoint)
+    memset(p->fixedbus, 0, frames*2*sizeof(int32_t));
+  else if(!p->silent)
+    memset(p->audiobuf, 0, frames*2*sizeof(float));
+  if(p->stats && !p->silent)
+  {
+    uint64_t* channelns = p->stats->channelns;
+    for(int i = 0; i < p->mod->numchannels; i++)
+    {
+      double start = now();
+      processnote(p, &p->channels[i], p->curnote + i);
+      bump(&channelns[i], (now()-start)*1e9);
+    }
+  }
+  else
+  {
+    for(int i = 0; i < p->mod->numchannels; i++)
+      processnote(p, &p->channels[i], p->curnote + i);
+  }
+  p->frame += frames;
 
-  globaltick++;
-  if(globaltick == gm->speed)
+  p->globaltick++;
+  if(p->globaltick == p->mod->speed)
   {
-    if(delcount)
+    if(p->delcount)
     {
-      inrepeat = true;
-      delcount--;
+      p->inrepeat = true;
+      p->delcount--;
     }
     else
     {
-      delset = false;
-      addflag = false;
-      inrepeat = false;
-      if(currow == row) row++;
+      p->delset = false;
+      p->addflag = false;
+      p->inrepeat = false;
+      if(p->currow == p->row) p->row++;
     }
-    globaltick = 0;
+    p->globaltick = 0;
+  }
+}
+
+void freemod(modfile* m)
+{
+  for(int i = 0; i < m->numsamples; i++)
+  {
+    if(m->samples[i] == NULL) continue;
+    if(m->samples[i]->owned) free(m->samples[i]->sampledata);
+    if(m->samples[i]->store) free(m->samples[i]->store-SAMPLE_PAD);
+    if(m->samples[i]->store8) free(m->samples[i]->store8-SAMPLE_PAD);
+    free(m->samples[i]);
   }
+  free(m->notes.period);
+  if(m->mapped) munmap(m->image, m->imagelength);
+  else free(m->image);
+  free(m);
 }
 
-modfile* modparse(FILE* f)
+//channel count from the tag at 1080, 0 if it isn't one of the 31 sample
+//formats. nnCH counts above MAX_CHANNELS come back as they are, for the
+//caller to reject
+int magicchannels(const char* magic)
 {
-  uint8_t* filearr = malloc(filelength*sizeof(uint8_t));
-  int seek = 0;
-  int c;
-  while((c = fgetc(f)) != EOF)
-    filearr[seek++] = (uint8_t)c;
-  modfile* m = malloc(sizeof(modfile));
+  if(!strcmp(magic, "M.K.") || !strcmp(magic, "M!K!") ||
+     !strcmp(magic, "4CHN") || !strcmp(magic, "FLT4")) return 4;
+  if(!strcmp(magic, "CD81") || !strcmp(magic, "OKTA") ||
+     !strcmp(magic, "OCTA") || !strcmp(magic, "FLT8")) return 8;
+  if(!strncmp(magic, "TDZ", 3) && magic[3] >= '1' && magic[3] <= '3')
+    return magic[3]-'0';
+  int n = 0;
+  //nCHN (FastTracker) or nnCH (TakeTracker)
+  if(magic[0] >= '1' && magic[0] <= '9' && !strcmp(magic+1, "CHN"))
+    n = magic[0]-'0';
+  else if(magic[0] >= '1' && magic[0] <= '9' &&
+          magic[1] >= '0' && magic[1] <= '9' && !strcmp(magic+2, "CH"))
+    n = (magic[0]-'0')*10 + magic[1]-'0';
+  return n;
+}
+
+/*splits every 4 byte cell into the notetable, so the player never has to
+  pick the bits apart or search the period table again. Startrekker's FLT8
+  stores each 8 channel pattern as two 4 channel ones, channels 1-4 then
+  5-8, and its orders count in those halves*/
+void decodepatterns(modfile* m, const uint8_t* src, int numpatterns, bool flt8)
+{
+  uint32_t count = numpatterns*64*m->numchannels;
+  notetable* t = &m->notes;
+  t->period = malloc(count*(sizeof(uint16_t)+4));
+  t->note = (int8_t*)(t->period+count);
+  t->sample = (uint8_t*)t->note+count;
+  t->effect = t->sample+count;
+  t->param = t->effect+count;
+  for(uint32_t n = 0; n < count; n++)
+  {
+    int chan = n%m->numchannels;
+    int row = n/m->numchannels%64;
+    int pat = n/m->numchannels/64;
+    const uint8_t* data;
+    if(flt8)
+      data = src + (2*pat+chan/4)*1024 + row*16 + (chan%4)*4;
+    else data = src + n*4;
+    t->period[n] = ((uint16_t)(data[0]&0x0F)<<8) | data[1];
+    t->note[n] = findperiod(t->period[n]);
+    t->sample[n] = (data[0]&0xF0) | (data[2]>>4);
+    t->effect[n] = data[2]&0x0F;
+    t->param[n] = data[3];
+  }
+}
+
+//returns false if the file is too short to be a mod, or has more channels
+//than MAX_CHANNELS
+//parses in place: samples point into filearr, which the caller
+//must keep alive until freemod
+bool modparse(player* p, const uint8_t* filearr, size_t filelength)
+{
+  if(filelength < 600) return false;
+  modfile* m = calloc(1, sizeof(modfile));
+  p->mod = m;
   strncpy((char*)m->name, (char*)filearr, 20);
   m->name[20] = '\x00';
   //printw("%s\n", m->name);
-  memcpy(m->magicstring, filearr+1080, 4);
+  if(filelength >= 1084) memcpy(m->magicstring, filearr+1080, 4);
   m->magicstring[4] = '\x00';
-  if(strcmp(m->magicstring, "M.K.") && strcmp(m->magicstring, "4CHN"))
+  m->numchannels = magicchannels(m->magicstring);
+  if(m->numchannels > MAX_CHANNELS)
   {
-    printw("Warning: Not a 31 instrument 4 channel MOD file. May not be playable.\n");
-    type = 1;
+    report("Unsupported channel count: %s, at most %d channels.\n",
+           m->magicstring, MAX_CHANNELS);
+    freemod(m);
+    return false;
   }
-  else type = 0;
+  if(!m->numchannels)
+  {
+    report("Warning: Not a 31 instrument MOD file. May not be playable.\n");
+    m->type = 1;
+    m->numchannels = 4;
+  }
+  else m->type = 0;
+  bool flt8 = !strcmp(m->magicstring, "FLT8");
 
-  numsamples = type?15:31;
+  m->numsamples = m->type?15:31;
   //printw("magic string%s\n", m->magicstring);
-  if (type == 0) m->songlength = filearr[950];
+  if (m->type == 0) m->songlength = filearr[950];
   else m->songlength = filearr[470];
+  if(m->songlength > 128) m->songlength = 128;
   //printw("songlength: %d\n", m->songlength);
-  if (type == 0) memcpy(m->patternlist, filearr+952, 128);
+  if (m->type == 0) memcpy(m->patternlist, filearr+952, 128);
   else memcpy(m->patternlist, filearr+472, 128);
+  if(flt8)
+    for(int i = 0; i < 128; i++) m->patternlist[i] /= 2;
   /*printw("patterns:\n");
   for(int i = 0; i < m->songlength; i++)
   {
@@ -959,166 +2188,2372 @@ modfile* modparse(FILE* f)
     if(m->patternlist[i] > max) max = m->patternlist[i];
   }
   //printw("max: %d\n", max);
-  uint32_t len = (uint32_t)(1024*(max+1)); //1024 = size of pattern
-  m->patterns = malloc(len);
+  uint32_t len = 256*m->numchannels*(max+1);
   uint16_t size;
-  if(type == 0) size = 1084;
+  if(m->type == 0) size = 1084;
   else size = 600;
-  memcpy(m->patterns, filearr+size, len);
-  sampleparse(m, filearr, len+size);
+  if(size+len > filelength)
+  {
+    freemod(m);
+    return false;
+  }
+  decodepatterns(m, filearr+size, max+1, flt8);
+  if(!sampleparse(m, filearr, len+size, filelength))
+  {
+    freemod(m);
+    return false;
+  }
   m->speed = 6; //default speed = 6
-  nextspeed = 6;
+  p->nextspeed = 6;
   m->tempo = 125;
-  nexttempo = 125;
-  ticktime = 0.02;
-  nextticktime = 0.02;
+  p->nexttempo = 125;
+  p->ticktime = 0.02;
+  p->nextticktime = 0.02;
   //printw("secsperrow: %f\n", m->secsperrow);
-  free(filearr);
-  return m;
+  return true;
 }
-char* filename;
-int main(int argc, char *argv[])
-{
-  if(argc < 2) goto fileerror;
-  headphones = false;
-  for(int i = 1; i < argc; i++)
-  {
-    switch(*argv[i])
-    {
-      case '-':
-        switch(*(argv[i]+1))
-        {
-          case 'h':
-            headphones = true;
-            break;
-          case 'l':
-            loop = true;
-            break;
-        }
-        break;
-      default:
-        filename = argv[i];
-    }
-  }
-  struct stat s;
-  if(stat(filename, &s) == 0 && !S_ISREG(s.st_mode)) goto fileerror;
-  FILE* f = fopen(filename, "rb");
-  if(f == NULL) goto fileerror;
-  fseek(f, 0L, SEEK_END);
-  filelength = ftell(f);
-  if(filelength <= 0) goto fileerror;
-  fseek(f, 0L,SEEK_SET);
-  initscr();
-  start_color();
-  curs_set(0);
-  init_pair(1, COLOR_YELLOW, COLOR_BLACK);
-  attron(COLOR_PAIR(1));
-  printw("MFoP 1.1.4: A tiny ProTracker MOD player\nBaked with love\n");
-  attroff(COLOR_PAIR(1));
-  init_pair(2, COLOR_BLUE, COLOR_BLACK);
-  attron(COLOR_PAIR(2));
-  refresh();
-  patternwin = newwin(20, 49, 5, 0);
-  //instrwin = newwin()
-  box(patternwin, 0, 0);
-  init_pair(5, COLOR_BLACK, COLOR_WHITE);
-  wcolor_set(patternwin, COLOR_PAIR(2), NULL);
-  wattron(patternwin, COLOR_PAIR(5));
-  //allocate buffer for pattern viewer (includes null byte at end of line)
-  displaypatterns = malloc(3136*sizeof(char));
-  gm = modparse(f);
 
-  fclose(f);
-  gcp = initsound();
-  patternset = false;
-  //printw("Successfully initialized sound.\n");
+typedef enum {OUT_WAV, OUT_F32, OUT_S16} outformat;
 
-  pa_error = Pa_StartStream(stream);
-  if(pa_error != paNoError) portaudioerror(pa_error);
+typedef struct{
+  FILE* file;
+  outformat type;
+  uint64_t frames;
+  uint8_t* buf;
+  uint32_t block; //streaming: bytes gathered in buf for each write(), 0 if not
+  uint32_t fill;
+  bool broken; //the reader went away or a write failed
+} output;
 
-  curdata = gm->patterns + ((gm->patternlist[pattern])*1024) + (16*row);
-  renderpattern(gm->patterns + gm->patternlist[pattern]*1024);
-  init_pair(3, COLOR_WHITE, COLOR_BLACK);
-  attroff(COLOR_PAIR(2));
-  attron(COLOR_PAIR(3));
-  mvprintw(3, 0, "Title: %s", gm->name);
-  attroff(COLOR_PAIR(3));
-  attron(COLOR_PAIR(2));
+void putle(FILE* f, uint32_t value, int bytes)
+{
+  for(int i = 0; i < bytes; i++)
+    fputc((value>>(8*i))&0xFF, f);
+}
 
-  noecho();
-  bool pause = false;
-  nodelay(stdscr, true);
-  char c;
-  while(!done)
+//16 bit stereo PCM header, sizes are patched once the render is finished
+void wavheader(FILE* f, uint32_t datasize)
+{
+  fwrite("RIFF", 1, 4, f);
+  putle(f, datasize+36, 4);
+  fwrite("WAVEfmt ", 1, 8, f);
+  putle(f, 16, 4);
+  putle(f, 1, 2); //PCM
+  putle(f, 2, 2);
+  putle(f, samplerate, 4);
+  putle(f, samplerate*4, 4);
+  putle(f, 4, 2);
+  putle(f, 16, 2);
+  fwrite("data", 1, 4, f);
+  putle(f, datasize, 4);
+}
+
+outformat formatfromname(char* name)
+{
+  char* ext = strrchr(name, '.');
+  if(ext && (!strcmp(ext, ".f32") || !strcmp(ext, ".raw"))) return OUT_F32;
+  if(ext && (!strcmp(ext, ".s16") || !strcmp(ext, ".pcm"))) return OUT_S16;
+  return OUT_WAV;
+}
+
+//hands the gathered ticks to the pipe in one write(), or as few as it takes
+void flushstream(output* o)
+{
+  uint32_t done = 0;
+  while(done < o->fill && !o->broken)
   {
-    input_loop:
-    c = getch();
-    switch (c)
-    {
+    ssize_t r = write(fileno(o->file), o->buf+done, o->fill-done);
+    if(r > 0) done += r;
+    else if(r < 0 && errno != EINTR) o->broken = true;
+  }
+  o->fill = 0;
+}
+
+void writeframes(output* o, float* buf, int frames)
+{
+  if(o->block)
+  {
+    int bytes = frames*(o->type == OUT_F32 ? 8 : 4);
+    if(o->fill+bytes > o->block) flushstream(o);
+    if(o->type == OUT_F32) memcpy(o->buf+o->fill, buf, bytes);
+    else packs16(o->buf+o->fill, buf, frames*2);
+    o->fill += bytes;
+  }
+  else if(o->type == OUT_F32)
+    fwrite(buf, sizeof(float), frames*2, o->file);
+  else
+  {
+    //clip and pack little endian into o->buf so each tick is one fwrite
+    packs16(o->buf, buf, frames*2);
+    fwrite(o->buf, 2, frames*2, o->file);
+  }
+  o->frames += frames;
+}
+
+void packpcm(uint8_t* out, const int16_t* in, int n)
+{
+  for(int i = 0; i < n; i++)
+  {
+    out[i*2] = (uint16_t)in[i]&0xFF;
+    out[i*2+1] = (uint16_t)in[i]>>8;
+  }
+}
+
+//writeframes() for the fixed point engine's int16 ticks
+void writepcm(output* o, const int16_t* pcm, int frames)
+{
+  int bytes = frames*(o->type == OUT_F32 ? 8 : 4);
+  if(o->block && o->fill+bytes > o->block) flushstream(o);
+  uint8_t* out = o->block ? o->buf+o->fill : o->buf;
+  if(o->type == OUT_F32)
+  {
+    float* f = (float*)out;
+    for(int i = 0; i < frames*2; i++) f[i] = pcm[i]*(1.0f/32767.0f);
+  }
+  else packpcm(out, pcm, frames*2);
+  if(o->block) o->fill += bytes;
+  else fwrite(out, 1, bytes, o->file);
+  o->frames += frames;
+}
+
+//both lanes in one pass, so their two dependency chains overlap
+void runbiquad(const biquad* f, biquadstate* s, float* buf, int frames)
+{
+  double l1 = s->z1[0], l2 = s->z2[0];
+  double r1 = s->z1[1], r2 = s->z2[1];
+  for(int i = 0; i < frames; i++)
+  {
+    double l = buf[i*2];
+    double r = buf[i*2+1];
+    double yl = f->b0*l + l1;
+    double yr = f->b0*r + r1;
+    l1 = f->b1*l - f->a1*yl + l2;
+    r1 = f->b1*r - f->a1*yr + r2;
+    l2 = f->b2*l - f->a2*yl;
+    r2 = f->b2*r - f->a2*yr;
+    buf[i*2] = yl;
+    buf[i*2+1] = yr;
+  }
+  //let silence decay to zero rather than into denormals
+  s->z1[0] = fabs(l1) < 1e-20 ? 0 : l1;
+  s->z2[0] = fabs(l2) < 1e-20 ? 0 : l2;
+  s->z1[1] = fabs(r1) < 1e-20 ? 0 : r1;
+  s->z2[1] = fabs(r2) < 1e-20 ? 0 : r2;
+}
+
+//runbiquad() on the fixed point bus
+void runbiquadfixed(const fixedbiquad* f, biquadstate* s, int32_t* buf,
+                    int frames)
+{
+  int64_t l1 = s->q1[0], l2 = s->q2[0];
+  int64_t r1 = s->q1[1], r2 = s->q2[1];
+  for(int i = 0; i < frames; i++)
+  {
+    int64_t l = buf[i*2];
+    int64_t r = buf[i*2+1];
+    int64_t yl = (f->b0*l + l1)>>28;
+    int64_t yr = (f->b0*r + r1)>>28;
+    l1 = f->b1*l - f->a1*yl + l2;
+    r1 = f->b1*r - f->a1*yr + r2;
+    l2 = f->b2*l - f->a2*yl;
+    r2 = f->b2*r - f->a2*yr;
+    buf[i*2] = yl;
+    buf[i*2+1] = yr;
+  }
+  s->q1[0] = l1;
+  s->q2[0] = l2;
+  s->q1[1] = r1;
+  s->q2[1] = r2;
+}
+
+//the Amiga's output filters, once on the mixed stereo bus
+void filteroutput(player* p, float* buf, int frames)
+{
+  if(haslowpass)
+    runbiquad(&lowpassfilter, &p->lowpass, buf, frames);
+  if(outputfilter >= FILTER_A500)
+    runbiquad(&highpassfilter, &p->highpass, buf, frames);
+  if(outputfilter != FILTER_NONE && p->led)
+    runbiquad(&ledfilter, &p->ledstate, buf, frames);
+}
+
+//mixoutput() for the fixed point engine: filters and headphones mixing on
+//the bus, then rounded and clipped to int16 in p->pcm
+int16_t* mixoutputfixed(player* p, int frames)
+{
+  int32_t* bus = p->fixedbus;
+  if(haslowpass) runbiquadfixed(&lowpassfixed, &p->lowpass, bus, frames);
+  if(outputfilter >= FILTER_A500)
+    runbiquadfixed(&highpassfixed, &p->highpass, bus, frames);
+  if(outputfilter != FILTER_NONE && p->led)
+    runbiquadfixed(&ledfixed, &p->ledstate, bus, frames);
+  if(__atomic_load_n(&p->headphones, __ATOMIC_RELAXED))
+  {
+    for(int i = 0; i < frames; i++)
+    {
+      int32_t l = bus[i*2];
+      int32_t r = bus[i*2+1];
+      bus[i*2] = l+(r>>1);
+      bus[i*2+1] = r+(l>>1);
+    }
+  }
+  for(int i = 0; i < frames*2; i++)
+  {
+    int32_t v = (bus[i]+(1<<(FIXED_SHIFT-1)))>>FIXED_SHIFT;
+    p->pcm[i] = v > 32767 ? 32767 : v < -32767 ? -32767 : v;
+  }
+  return p->pcm;
+}
+
+//apply the output filters and headphones mixing in place if enabled,
+//returns the buffer to send out
+float* mixoutput(player* p, int frames)
+{
+  if(fixedpoint)
+  {
+    //the ring and PortAudio take float, so convert once at the very end
+    const int16_t* pcm = mixoutputfixed(p, frames);
+    for(int i = 0; i < frames*2; i++)
+      p->audiobuf[i] = pcm[i]*(1.0f/32767.0f);
+    return p->audiobuf;
+  }
+  filteroutput(p, p->audiobuf, frames);
+  if(__atomic_load_n(&p->headphones, __ATOMIC_RELAXED))
+    crossfeed(p->audiobuf, frames);
+  return p->audiobuf;
+}
+
+void freeplayer(player* p)
+{
+  for(int i = 0; i < p->mod->numchannels; i++)
+  {
+    if(p->channels[i].converter) src_delete(p->channels[i].converter);
+    free(p->channels[i].buffer);
+    free(p->channels[i].resampled);
+    free(p->channels[i].cdata);
+  }
+  free(p->channels);
+  free(p->audiobuf);
+  free(p->channelbuf);
+  free(p->fixedbus);
+  free(p->fixedbuf);
+  free(p->pcm);
+  freemod(p->mod);
+}
+
+//maps the file and parses it in place, falling back to reading it into
+//memory where mmap is not available
+bool modload(player* p, char* filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if(fd < 0) return false;
+  struct stat s;
+  if(fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) || s.st_size <= 0)
+  {
+    close(fd);
+    return false;
+  }
+  size_t length = s.st_size;
+  bool mapped = true;
+  uint8_t* image = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(image == MAP_FAILED)
+  {
+    mapped = false;
+    image = malloc(length);
+    size_t got = 0;
+    while(got < length)
+    {
+      ssize_t r = read(fd, image+got, length-got);
+      if(r <= 0) break;
+      got += r;
+    }
+    length = got;
+  }
+  close(fd);
+  if(!modparse(p, image, length))
+  {
+    if(mapped) munmap(image, s.st_size);
+    else free(image);
+    return false;
+  }
+  p->mod->image = image;
+  p->mod->imagelength = length;
+  p->mod->mapped = mapped;
+  return true;
+}
+
+//open filename, parse it and set up the channels
+bool loadsong(player* p, char* filename)
+{
+  bool ok = modload(p, filename);
+  if(ok) initsound(p);
+  return ok;
+}
+
+void savecheckpoint(player* p, checkpoint* cp)
+{
+  cp->state = *p;
+  cp->channels = malloc(p->mod->numchannels*sizeof(channel));
+  memcpy(cp->channels, p->channels, p->mod->numchannels*sizeof(channel));
+  for(int i = 0; i < p->mod->numsamples; i++)
+    cp->finetunes[i] = p->mod->samples[i]->finetune;
+  cp->speed = p->mod->speed;
+  cp->tempo = p->mod->tempo;
+}
+
+//puts the song back where cp was taken, leaving buffers and settings alone
+void restorecheckpoint(player* p, checkpoint* cp)
+{
+  player* s = &cp->state;
+  memcpy(p->visited, s->visited, sizeof(p->visited));
+  p->pattern = s->pattern;
+  p->row = s->row;
+  p->currow = s->currow;
+  p->curpattern = s->curpattern;
+  p->addflag = s->addflag;
+  p->curnote = s->curnote;
+  p->done = s->done;
+  p->globaltick = s->globaltick;
+  p->patternset = s->patternset;
+  p->delcount = s->delcount;
+  p->delset = s->delset;
+  p->inrepeat = s->inrepeat;
+  p->ticktime = s->ticktime;
+  p->nextticktime = s->nextticktime;
+  p->framecarry = s->framecarry;
+  p->carryunit = s->carryunit;
+  p->nexttempo = s->nexttempo;
+  p->nextspeed = s->nextspeed;
+  p->frame = s->frame;
+  setled(p, s->led);
+  for(int i = 0; i < p->mod->numchannels; i++)
+  {
+    channel* c = &p->channels[i];
+    channel saved = cp->channels[i];
+    saved.buffer = c->buffer;
+    saved.resampled = c->resampled;
+    saved.converter = c->converter;
+    saved.cdata = c->cdata;
+    *c = saved;
+    if(c->converter) src_reset(c->converter);
+  }
+  for(int i = 0; i < p->mod->numsamples; i++)
+    p->mod->samples[i]->finetune = cp->finetunes[i];
+  p->mod->speed = cp->speed;
+  p->mod->tempo = cp->tempo;
+}
+
+/*runs the whole song through the sequencer without mixing, noting where
+  every row starts and checkpointing every CHECKPOINT_ROWS rows, then goes
+  back to the start. EFx inversions are not replayed, so after a seek the
+  looped sample data is as the last playback left it*/
+void buildindex(player* p, seekindex* ix)
+{
+  int rowcap = 1024;
+  int checkcap = 64;
+  memset(ix, 0, sizeof(seekindex));
+  ix->rows = malloc(rowcap*sizeof(rowmark));
+  ix->checkpoints = malloc(checkcap*sizeof(checkpoint));
+  for(int i = 0; i < 128; i++) ix->orderframes[i] = UINT64_MAX;
+  bool loop = p->loop;
+  bool stopatloop = p->stopatloop;
+  p->loop = false;
+  p->silent = true;
+  p->stopatloop = true;
+  p->curnote = rownote(p->mod, p->pattern, p->row);
+  int sincecheck = CHECKPOINT_ROWS;
+  while(!p->done)
+  {
+    bool rowstart = p->globaltick == 0;
+    if(rowstart && sincecheck >= CHECKPOINT_ROWS)
+    {
+      if(ix->numcheckpoints == checkcap)
+      {
+        checkcap *= 2;
+        ix->checkpoints = realloc(ix->checkpoints, checkcap*sizeof(checkpoint));
+      }
+      savecheckpoint(p, &ix->checkpoints[ix->numcheckpoints++]);
+      sincecheck = 0;
+    }
+    uint64_t frame = p->frame;
+    steptick(p);
+    if(p->done || !rowstart) continue;
+    if(ix->numrows == rowcap)
+    {
+      rowcap *= 2;
+      ix->rows = realloc(ix->rows, rowcap*sizeof(rowmark));
+    }
+    rowmark* r = &ix->rows[ix->numrows++];
+    r->frame = frame;
+    r->order = p->curpattern;
+    r->row = p->currow;
+    if(ix->orderframes[r->order] == UINT64_MAX)
+      ix->orderframes[r->order] = frame;
+    sincecheck++;
+  }
+  ix->length = p->frame;
+  //stopped on a jump back: note the first time the row jumped to was played
+  ix->loopstart = UINT64_MAX;
+  if(p->pattern < p->mod->songlength)
+  {
+    ix->loopstart = ix->orderframes[p->pattern];
+    for(int i = 0; i < ix->numrows; i++)
+    {
+      if(ix->rows[i].order == p->pattern && ix->rows[i].row == p->row)
+      {
+        ix->loopstart = ix->rows[i].frame;
+        break;
+      }
+    }
+  }
+  p->silent = false;
+  p->stopatloop = stopatloop;
+  p->loop = loop;
+  restorecheckpoint(p, &ix->checkpoints[0]);
+}
+
+void freeindex(seekindex* ix)
+{
+  free(ix->rows);
+  for(int i = 0; i < ix->numcheckpoints; i++)
+    free(ix->checkpoints[i].channels);
+  free(ix->checkpoints);
+}
+
+//playback keeps counting frames after a Bxx/Dxx jump back, so fold frames
+//past the end of the indexed pass back into the part of it that repeats
+uint64_t indexframe(seekindex* ix, uint64_t frame)
+{
+  if(frame < ix->length || ix->loopstart == UINT64_MAX) return frame;
+  return ix->loopstart + (frame-ix->loopstart)%(ix->length-ix->loopstart);
+}
+
+//the row playing at frame, or the first one
+rowmark* findrow(seekindex* ix, uint64_t frame)
+{
+  int lower = 0;
+  int upper = ix->numrows-1;
+  while(lower < upper)
+  {
+    int mid = (lower+upper+1)/2;
+    if(ix->rows[mid].frame <= frame) lower = mid;
+    else upper = mid-1;
+  }
+  return &ix->rows[lower];
+}
+
+//restores the last checkpoint before frame and replays up to the first tick
+//starting at or after it
+void seekplayer(player* p, seekindex* ix, uint64_t frame)
+{
+  if(ix->numrows == 0) return;
+  frame = indexframe(ix, frame);
+  if(frame > ix->rows[ix->numrows-1].frame)
+    frame = ix->rows[ix->numrows-1].frame;
+  int lower = 0;
+  int upper = ix->numcheckpoints-1;
+  while(lower < upper)
+  {
+    int mid = (lower+upper+1)/2;
+    if(ix->checkpoints[mid].state.frame <= frame) lower = mid;
+    else upper = mid-1;
+  }
+  restorecheckpoint(p, &ix->checkpoints[lower]);
+  p->silent = true;
+  while(!p->done && p->frame < frame) steptick(p);
+  p->silent = false;
+}
+
+//the player fields the next row's audio depends on, besides the channels.
+//Filled after a memset so the padding hashes and compares the same
+typedef struct{
+  int pattern;
+  int row;
+  uint32_t speed;
+  uint16_t tempo;
+  uint8_t nextspeed;
+  uint8_t nexttempo;
+  uint8_t delcount;
+  bool addflag;
+  bool patternset;
+  bool delset;
+  bool inrepeat;
+  bool led;
+  double ticktime;
+  double nextticktime;
+  uint64_t framecarry;
+  uint64_t carryunit;
+  int8_t finetunes[31];
+} rowstate;
+
+//one row as rendered from a given state, before the output filters
+typedef struct cacheentry{
+  uint64_t hash;
+  void* key; //rowstate followed by the channels, compared on a hit
+  size_t keysize;
+  void* audio; //audiobuf or fixedbus frames, 8 bytes each
+  uint32_t frames;
+  uint32_t capacity; //frames audio has room for while recording
+  int ticks;
+  uint16_t tickframes[32];
+  bool led[32]; //E0x can switch the LED filter part way through
+  checkpoint end; //the state the row leaves behind
+  size_t bytes;
+  struct cacheentry* next; //in the hash bucket
+  struct cacheentry* newer; //least recently used order
+  struct cacheentry* older;
+} cacheentry;
+
+/*--cache: with -l the same rows come round again from the same state, so
+  keep their audio and play it back instead of mixing it again. Entries are
+  dropped least recently used first to stay under cap*/
+typedef struct rendercache{
+  cacheentry* buckets[4096];
+  cacheentry* newest;
+  cacheentry* oldest;
+  size_t bytes;
+  size_t cap;
+  cacheentry* recording; //the row being rendered, kept if it finishes
+  cacheentry* replaying;
+  int tick; //of the row being replayed
+  uint32_t offset; //frames of it already played
+  uint64_t hits; //rows
+  uint64_t misses;
+} rendercache;
+
+//can the row about to start be stored? EFx rewrites sample data as it
+//plays, and libsamplerate keeps state of its own, so neither can be replayed
+bool cacheable(player* p)
+{
+  if(uselibsrc || p->done) return false;
+  for(int i = 0; i < p->mod->numchannels; i++)
+    if(p->channels[i].funkspeed) return false;
+  return true;
+}
+
+//p's state at the start of a row as a key, its FNV-1a hash into hash
+void* rowkey(player* p, size_t* size, uint64_t* hash)
+{
+  int numchannels = p->mod->numchannels;
+  *size = sizeof(rowstate)+numchannels*sizeof(channel);
+  uint8_t* key = malloc(*size);
+  rowstate* r = (rowstate*)key;
+  memset(r, 0, sizeof(rowstate));
+  r->pattern = p->pattern;
+  r->row = p->row;
+  r->speed = p->mod->speed;
+  r->tempo = p->mod->tempo;
+  r->nextspeed = p->nextspeed;
+  r->nexttempo = p->nexttempo;
+  r->delcount = p->delcount;
+  r->addflag = p->addflag;
+  r->patternset = p->patternset;
+  r->delset = p->delset;
+  r->inrepeat = p->inrepeat;
+  r->led = p->led;
+  r->ticktime = p->ticktime;
+  r->nextticktime = p->nextticktime;
+  r->framecarry = p->framecarry;
+  r->carryunit = p->carryunit;
+  for(int i = 0; i < p->mod->numsamples; i++)
+    r->finetunes[i] = p->mod->samples[i]->finetune;
+  //channels only ever come from calloc and whole copies, so their padding
+  //is zero, and if it weren't it could only cause a miss
+  memcpy(key+sizeof(rowstate), p->channels, numchannels*sizeof(channel));
+  uint64_t h = 14695981039346656037u;
+  for(size_t i = 0; i < *size; i++) h = (h^key[i])*1099511628211u;
+  *hash = h;
+  return key;
+}
+
+void freeentry(cacheentry* e)
+{
+  free(e->key);
+  free(e->audio);
+  free(e->end.channels);
+  free(e);
+}
+
+//takes e out of the least recently used list
+void unlinkentry(rendercache* rc, cacheentry* e)
+{
+  if(e->newer) e->newer->older = e->older;
+  else rc->newest = e->older;
+  if(e->older) e->older->newer = e->newer;
+  else rc->oldest = e->newer;
+}
+
+void pushentry(rendercache* rc, cacheentry* e)
+{
+  e->newer = NULL;
+  e->older = rc->newest;
+  if(rc->newest) rc->newest->newer = e;
+  rc->newest = e;
+  if(rc->oldest == NULL) rc->oldest = e;
+}
+
+void evictentry(rendercache* rc, cacheentry* e)
+{
+  cacheentry** link = &rc->buckets[e->hash&4095];
+  while(*link != e) link = &(*link)->next;
+  *link = e->next;
+  unlinkentry(rc, e);
+  __atomic_store_n(&rc->bytes, rc->bytes-e->bytes, __ATOMIC_RELAXED);
+  freeentry(e);
+}
+
+cacheentry* findentry(rendercache* rc, void* key, size_t size, uint64_t hash)
+{
+  for(cacheentry* e = rc->buckets[hash&4095]; e; e = e->next)
+    if(e->hash == hash && e->keysize == size && !memcmp(e->key, key, size))
+      return e;
+  return NULL;
+}
+
+//files the row just recorded, then evicts until the cache fits its cap
+void storeentry(rendercache* rc, player* p)
+{
+  cacheentry* e = rc->recording;
+  rc->recording = NULL;
+  e->audio = realloc(e->audio, e->frames*8);
+  savecheckpoint(p, &e->end);
+  e->bytes = sizeof(cacheentry)+e->keysize+e->frames*8+
+    p->mod->numchannels*sizeof(channel);
+  e->next = rc->buckets[e->hash&4095];
+  rc->buckets[e->hash&4095] = e;
+  pushentry(rc, e);
+  __atomic_store_n(&rc->bytes, rc->bytes+e->bytes, __ATOMIC_RELAXED);
+  while(rc->bytes > rc->cap && rc->oldest) evictentry(rc, rc->oldest);
+}
+
+//a seek leaves whatever row was being recorded or replayed
+void cachereset(rendercache* rc)
+{
+  if(rc->recording)
+  {
+    free(rc->recording->key);
+    free(rc->recording->audio);
+    free(rc->recording);
+  }
+  rc->recording = NULL;
+  rc->replaying = NULL;
+}
+
+void freecache(rendercache* rc)
+{
+  cachereset(rc);
+  while(rc->oldest) evictentry(rc, rc->oldest);
+}
+
+//the next tick of the row being replayed, as steptick() would have made it
+void replaytick(player* p, rendercache* rc)
+{
+  cacheentry* e = rc->replaying;
+  int frames = e->tickframes[rc->tick];
+  void* bus = fixedpoint ? (void*)p->fixedbus : (void*)p->audiobuf;
+  memcpy(bus, (uint8_t*)e->audio+rc->offset*8, frames*8);
+  setled(p, e->led[rc->tick]);
+  p->tickframes = frames;
+  p->frame += frames;
+  rc->offset += frames;
+  if(++rc->tick < e->ticks) return;
+  uint64_t frame = p->frame;
+  restorecheckpoint(p, &e->end);
+  p->frame = frame;
+  rc->replaying = NULL;
+}
+
+/*steptick() through the cache: at the start of each row, replays it if it
+  was rendered before from exactly this state, otherwise renders it and
+  keeps it. The output filters and headphones mixing still run live*/
+void cachedtick(player* p, rendercache* rc)
+{
+  if(rc->replaying)
+  {
+    replaytick(p, rc);
+    return;
+  }
+  if(p->globaltick == 0 && cacheable(p))
+  {
+    size_t size;
+    uint64_t hash;
+    void* key = rowkey(p, &size, &hash);
+    cacheentry* e = findentry(rc, key, size, hash);
+    if(e)
+    {
+      free(key);
+      bump(&rc->hits, 1);
+      unlinkentry(rc, e);
+      pushentry(rc, e);
+      //what steptick() does at the start of a row, for the position display
+      p->curnote = rownote(p->mod, p->pattern, p->row);
+      p->currow = p->row;
+      p->curpattern = p->pattern;
+      rc->replaying = e;
+      rc->tick = 0;
+      rc->offset = 0;
+      replaytick(p, rc);
+      return;
+    }
+    bump(&rc->misses, 1);
+    e = calloc(1, sizeof(cacheentry));
+    e->key = key;
+    e->keysize = size;
+    e->hash = hash;
+    e->capacity = maxtickframes()*8;
+    e->audio = malloc(e->capacity*8);
+    rc->recording = e;
+  }
+  steptick(p);
+  cacheentry* e = rc->recording;
+  if(e == NULL) return;
+  //a row that ends the song, or runs longer than any speed allows, is dropped
+  if(p->done || e->ticks == 32)
+  {
+    cachereset(rc);
+    return;
+  }
+  if(e->frames+p->tickframes > e->capacity)
+  {
+    e->capacity *= 2;
+    e->audio = realloc(e->audio, e->capacity*8);
+  }
+  void* bus = fixedpoint ? (void*)p->fixedbus : (void*)p->audiobuf;
+  memcpy((uint8_t*)e->audio+e->frames*8, bus, p->tickframes*8);
+  e->tickframes[e->ticks] = p->tickframes;
+  e->led[e->ticks] = p->led;
+  e->ticks++;
+  e->frames += p->tickframes;
+  if(p->globaltick != 0) return;
+  if(cacheable(p)) storeentry(rc, p);
+  else cachereset(rc);
+}
+
+void sleepms(double ms)
+{
+  struct timespec t;
+  t.tv_sec = ms/1000;
+  t.tv_nsec = (ms-t.tv_sec*1000)*1e6;
+  nanosleep(&t, NULL);
+}
+
+//order, row, speed and tempo of the row being played, in one word so the UI
+//can read it without locking
+uint64_t packposition(player* p)
+{
+  return (uint64_t)p->curpattern | (uint64_t)p->currow << 8 |
+    (uint64_t)(p->mod->speed&0xFF) << 16 | (uint64_t)p->mod->tempo << 24;
+}
+
+//packposition() with the song's sequence number on top, so the UI only
+//draws positions of the song its view was built for
+void publishposition(playback* pb)
+{
+  uint64_t sequence = __atomic_load_n(&pb->sequence, __ATOMIC_RELAXED);
+  __atomic_store_n(&pb->position, packposition(pb->p) | sequence<<48,
+                   __ATOMIC_RELEASE);
+}
+
+//counts one rendered tick into the live playback counters, see perfstats
+void recordtick(perfstats* st, double elapsed, double length)
+{
+  uint32_t ns = elapsed*1e9;
+  uint32_t load = elapsed/length*10000;
+  uint32_t bucket = ns/10000 < 4095 ? ns/10000 : 4095;
+  bump(&st->ticks, 1);
+  bump(&st->tickns, ns);
+  bump(&st->audions, length*1e9);
+  if(ns < st->tickmin) __atomic_store_n(&st->tickmin, ns, __ATOMIC_RELAXED);
+  if(ns > st->tickmax) __atomic_store_n(&st->tickmax, ns, __ATOMIC_RELAXED);
+  if(load > st->loadmax) __atomic_store_n(&st->loadmax, load, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->histogram[bucket], st->histogram[bucket]+1,
+    __ATOMIC_RELAXED);
+}
+
+//a copy of the counters as they are now, safe to read from any thread
+void snapstats(perfstats* st, perfstats* out)
+{
+  out->ticks = __atomic_load_n(&st->ticks, __ATOMIC_RELAXED);
+  out->tickns = __atomic_load_n(&st->tickns, __ATOMIC_RELAXED);
+  out->audions = __atomic_load_n(&st->audions, __ATOMIC_RELAXED);
+  out->tickmin = __atomic_load_n(&st->tickmin, __ATOMIC_RELAXED);
+  out->tickmax = __atomic_load_n(&st->tickmax, __ATOMIC_RELAXED);
+  out->loadmax = __atomic_load_n(&st->loadmax, __ATOMIC_RELAXED);
+  for(int i = 0; i < 4096; i++)
+    out->histogram[i] = __atomic_load_n(&st->histogram[i], __ATOMIC_RELAXED);
+  for(int i = 0; i < MAX_CHANNELS; i++)
+    out->channelns[i] = __atomic_load_n(&st->channelns[i], __ATOMIC_RELAXED);
+  out->draws = __atomic_load_n(&st->draws, __ATOMIC_RELAXED);
+  out->drawns = __atomic_load_n(&st->drawns, __ATOMIC_RELAXED);
+  out->drawmax = __atomic_load_n(&st->drawmax, __ATOMIC_RELAXED);
+}
+
+//render time, in ms, that 99% of ticks came in under, to the histogram's
+//10us resolution
+double tickp99(perfstats* st)
+{
+  uint64_t count = 0;
+  int i = 0;
+  while(i < 4095 && (count += st->histogram[i]) < st->ticks*0.99) i++;
+  double ms = (i+1)/100.0;
+  return ms < st->tickmax/1e6 ? ms : st->tickmax/1e6;
+}
+
+//main thread: copies the render cache's counters into pb
+void snapcache(playback* pb)
+{
+  pb->cached = true;
+  pb->cachehits = __atomic_load_n(&pb->cache->hits, __ATOMIC_RELAXED);
+  pb->cachemisses = __atomic_load_n(&pb->cache->misses, __ATOMIC_RELAXED);
+  pb->cachebytes = __atomic_load_n(&pb->cache->bytes, __ATOMIC_RELAXED);
+}
+
+void writestats(playback* pb, FILE* f)
+{
+  perfstats st;
+  snapstats(&pb->stats, &st);
+  uint64_t ticks = st.ticks ? st.ticks : 1;
+  fprintf(f, "{\n  \"underruns\": %u,\n  \"ticks\": %llu,\n",
+    __atomic_load_n(&pb->underruns, __ATOMIC_RELAXED),
+    (unsigned long long)st.ticks);
+  fprintf(f, "  \"tick_ms\": {\"min\": %.3f, \"avg\": %.3f, \"p99\": %.3f, \"max\": %.3f},\n",
+    st.ticks ? st.tickmin/1e6 : 0, st.tickns/1e6/ticks, tickp99(&st),
+    st.tickmax/1e6);
+  fprintf(f, "  \"load\": {\"avg\": %.4f, \"max\": %.4f},\n",
+    st.audions ? (double)st.tickns/st.audions : 0, st.loadmax/10000.0);
+  fprintf(f, "  \"channel_us\": [");
+  for(int i = 0; i < pb->stats.numchannels; i++)
+    fprintf(f, "%s%.3f", i ? ", " : "", st.channelns[i]/1e3/ticks);
+  fprintf(f, "],\n  \"ui_ms\": {\"draws\": %llu, \"avg\": %.3f, \"max\": %.3f},\n",
+    (unsigned long long)st.draws, st.draws ? st.drawns/1e6/st.draws : 0,
+    st.drawmax/1e6);
+  fprintf(f, "  \"device\": {\"latency_ms\": %.3f, \"ring_ms\": %.3f, \"block\": %lu, \"callback_max\": %u}",
+    pb->outputlatency*1000, pb->target/samplerate*1000, blockframes,
+    __atomic_load_n(&pb->callbackmax, __ATOMIC_RELAXED));
+  if(pb->cache) snapcache(pb);
+  if(pb->cached)
+  {
+    fprintf(f, ",\n  \"cache\": {\"hits\": %llu, \"misses\": %llu, \"bytes\": %llu}",
+      (unsigned long long)pb->cachehits, (unsigned long long)pb->cachemisses,
+      (unsigned long long)pb->cachebytes);
+  }
+  fprintf(f, "\n}\n");
+}
+
+//--stats: overwrite the file with the counters so far
+void dumpstats(playback* pb)
+{
+  FILE* f = strcmp(statsname, "-") ? fopen(statsname, "w") : stderr;
+  if(f == NULL)
+  {
+    report("Could not open %s for writing.\n", statsname);
+    return;
+  }
+  writestats(pb, f);
+  if(f != stderr) fclose(f);
+}
+
+void statssignal(int sig)
+{
+  (void)sig;
+  statsrequested = 1;
+}
+
+//the i key: the counters over the pattern view and sample names
+void drawstats(playback* pb)
+{
+  perfstats st;
+  snapstats(&pb->stats, &st);
+  uint64_t ticks = st.ticks ? st.ticks : 1;
+  werase(statswin);
+  box(statswin, 0, 0);
+  mvwprintw(statswin, 1, 2, "render  %llu ticks  min %.2fms  avg %.2fms  p99 %.2fms  max %.2fms",
+    (unsigned long long)st.ticks, st.ticks ? st.tickmin/1e6 : 0,
+    st.tickns/1e6/ticks, tickp99(&st), st.tickmax/1e6);
+  mvwprintw(statswin, 2, 2, "load    avg %.1f%%  max %.1f%% of the tick's length",
+    st.audions ? 100.0*st.tickns/st.audions : 0, st.loadmax/100.0);
+  mvwprintw(statswin, 3, 2, "ui      %llu draws  avg %.2fms  max %.2fms",
+    (unsigned long long)st.draws, st.draws ? st.drawns/1e6/st.draws : 0,
+    st.drawmax/1e6);
+  mvwprintw(statswin, 4, 2, "device  latency %.1fms  ring %.1fms  callbacks up to %u frames",
+    pb->outputlatency*1000, pb->target/samplerate*1000,
+    __atomic_load_n(&pb->callbackmax, __ATOMIC_RELAXED));
+  mvwprintw(statswin, 5, 2, "processnote() per channel, average us per tick");
+  int percolumn = (COLS-4)/11 > 0 ? (COLS-4)/11 : 1;
+  for(int i = 0; i < pb->stats.numchannels; i++)
+    mvwprintw(statswin, 6+i/percolumn, 2+i%percolumn*11, "%2d %7.2f", i+1,
+      st.channelns[i]/1e3/ticks);
+  wnoutrefresh(statswin);
+}
+
+void recorddraw(perfstats* st, double elapsed)
+{
+  uint32_t ns = elapsed*1e9;
+  bump(&st->draws, 1);
+  bump(&st->drawns, ns);
+  if(ns > st->drawmax) __atomic_store_n(&st->drawmax, ns, __ATOMIC_RELAXED);
+}
+
+//sample names to the right of the pattern viewer
+void drawsamples(modfile* m, int column)
+{
+  for(int i = 0; i < m->numsamples && i+5 < LINES; i++)
+  {
+    sample* s = m->samples[i];
+    if(s->name[0]) mvprintw(i+5, column, "%02X %s", i+1, s->name);
+    else mvprintw(i+5, column, "%02X", i+1);
+  }
+}
+
+//what the pattern view last put on the terminal
+typedef struct{
+  int pattern; //order rendered into displaypatterns, -1 for none yet
+  int lines[18]; //pattern row on each line of the view, -1 for blank
+  uint64_t status; //position and underruns on the status line
+  double lastdraw;
+  bool showstats; //the counters instead of the pattern view
+} screen;
+
+void initscreen(screen* s)
+{
+  s->pattern = -1;
+  for(int i = 0; i < 18; i++) s->lines[i] = -2;
+  s->status = UINT64_MAX;
+  s->lastdraw = 0;
+  s->showstats = false;
+}
+
+/*draws the latest position the render thread published, at most once every
+  UI_FRAME_TIME and only touching lines that changed, then sends the lot to
+  the terminal in one doupdate()*/
+void drawscreen(playback* pb, screen* s)
+{
+  double time = now();
+  if(time-s->lastdraw < UI_FRAME_TIME) return;
+  player* p = pb->viewplayer;
+  uint64_t position = __atomic_load_n(&pb->position, __ATOMIC_ACQUIRE);
+  //already the next song's, wait for initview() to catch up
+  if(position>>48 != pb->viewsequence) return;
+  uint32_t underruns = __atomic_load_n(&pb->underruns, __ATOMIC_RELAXED);
+  uint64_t status = (position&0xFFFFFFFF) | (uint64_t)underruns<<32;
+  if(status == s->status && !s->showstats) return;
+  s->status = status;
+  s->lastdraw = time;
+  int pattern = position&0xFF;
+  int row = (position>>8)&0xFF;
+  attron(COLOR_PAIR(3));
+  mvprintw(4, 0, "position: 0x%02X  pattern: 0x%02X  row: 0x%02X  speed: 0x%02X  tempo: %d  underruns: %u\n",
+    pattern, p->mod->patternlist[pattern], row, (int)(position>>16)&0xFF,
+    (int)(position>>24)&0xFF, underruns);
+  attroff(COLOR_PAIR(3));
+  if(s->showstats)
+  {
+    wnoutrefresh(stdscr);
+    drawstats(pb);
+    doupdate();
+    recorddraw(&pb->stats, now()-time);
+    return;
+  }
+  if(pattern != s->pattern)
+  {
+    renderpattern(p->mod, pattern);
+    s->pattern = pattern;
+    for(int i = 0; i < 18; i++) s->lines[i] = -2;
+  }
+  //stop short of the right border so it never needs redrawing
+  int width = 12*viewchannels-1;
+  for(int line = -6; line < 12; line++)
+  {
+    int shown = row+line < 64 && row+line >= 0 ? row+line : -1;
+    if(s->lines[line+6] == shown) continue;
+    s->lines[line+6] = shown;
+    if(line == 0) wattron(patternwin, A_REVERSE);
+    if(shown >= 0)
+      mvwprintw(patternwin, 7+line, 1, " %.*s", width-1,
+        displaypatterns+shown*12*viewchannels);
+    else
+      mvwaddstr(patternwin, 7+line, 1, blankline);
+    if(line == 0) wattroff(patternwin, A_REVERSE);
+  }
+  wnoutrefresh(stdscr);
+  wnoutrefresh(patternwin);
+  doupdate();
+  recorddraw(&pb->stats, now()-time);
+}
+
+//seeks from what is being heard rather than what was last rendered, then
+//throws away the audio already queued
+void seekrelative(playback* pb, int32_t ms, int32_t orders)
+{
+  player* p = pb->p;
+  seekindex* ix = &pb->index;
+  uint32_t fill = ringfill(&pb->buffer);
+  //preloaded audio not yet queued is already counted in p->frame
+  uint32_t pending = fill + pb->leadframes-pb->leadpos;
+  int64_t heard = indexframe(ix, p->frame > pending ? p->frame-pending : 0);
+  int64_t target = heard + (int64_t)ms*samplerate/1000;
+  if(orders)
+  {
+    int order = findrow(ix, heard)->order+orders;
+    int step = orders > 0 ? 1 : -1;
+    while(order >= 0 && order < 128 && ix->orderframes[order] == UINT64_MAX)
+      order += step;
+    if(order < 0) order = 0;
+    if(order >= 128) return;
+    target = ix->orderframes[order];
+  }
+  if(target < 0) target = 0;
+  seekplayer(p, ix, target);
+  ringflush(&pb->buffer);
+  pb->leadpos = pb->leadframes;
+  publishposition(pb);
+}
+
+//loads a playlist entry, builds its seek index and renders its first
+//PRELOAD_MS, all off the render thread
+void* loadnext(void* arg)
+{
+  nextsong* n = arg;
+  player* p = &n->p;
+  if(!loadsong(p, n->name)) return NULL;
+  buildindex(p, &n->index);
+  p->curnote = rownote(p->mod, p->pattern, p->row);
+  uint32_t target = PRELOAD_MS/1000.0*samplerate;
+  n->lead = malloc((target+maxtickframes())*2*sizeof(float));
+  while(n->leadframes < target)
+  {
+    steptick(p);
+    if(p->done) break;
+    int frames = p->tickframes;
+    memcpy(n->lead+n->leadframes*2, mixoutput(p, frames),
+      frames*2*sizeof(float));
+    n->leadframes += frames;
+  }
+  n->ok = true;
+  return NULL;
+}
+
+//starts loading songs[number] in the background, from the top again with -l
+void queuesong(playback* pb, int number)
+{
+  if(number >= pb->numsongs)
+  {
+    if(!pb->repeat) return;
+    number = 0;
+  }
+  nextsong* n = calloc(1, sizeof(nextsong));
+  n->p = pb->settings;
+  n->number = number;
+  n->name = pb->songs[number];
+  pb->next = n;
+  pthread_create(&n->thread, NULL, loadnext, n);
+}
+
+void freesong(nextsong* n)
+{
+  if(n->ok)
+  {
+    freeplayer(&n->p);
+    freeindex(&n->index);
+  }
+  free(n->lead);
+  free(n);
+}
+
+/*called by the render thread when a song ends. Swaps in the next one, which
+  has normally finished loading long ago, skipping any that failed, and
+  hands the old one to the main thread. False at the end of the list*/
+bool advancesong(playback* pb)
+{
+  //the main thread frees the song before last within one UI frame
+  while(__atomic_load_n(&pb->retired, __ATOMIC_ACQUIRE))
+  {
+    if(__atomic_load_n(&pb->quit, __ATOMIC_ACQUIRE)) return false;
+    sleepms(1);
+  }
+  int failed = 0;
+  while(pb->next)
+  {
+    nextsong* n = pb->next;
+    pb->next = NULL;
+    pthread_join(n->thread, NULL);
+    if(!n->ok)
+    {
+      if(++failed < pb->numsongs) queuesong(pb, n->number+1);
+      freesong(n);
+      continue;
+    }
+    player* old = pb->p;
+    player* p = &n->p;
+    p->headphones = __atomic_load_n(&old->headphones, __ATOMIC_RELAXED);
+    p->stats = &pb->stats;
+    old->stats = NULL;
+    if(p->mod->numchannels > pb->stats.numchannels)
+      __atomic_store_n(&pb->stats.numchannels, p->mod->numchannels,
+                       __ATOMIC_RELAXED);
+    pb->retiredsong = pb->current;
+    pb->retiredindex = pb->index;
+    pb->current = n;
+    pb->index = n->index;
+    pb->lead = n->lead;
+    pb->leadframes = n->leadframes;
+    pb->leadpos = 0;
+    pb->song = n->number;
+    __atomic_store_n(&pb->sequence, pb->sequence+1, __ATOMIC_RELAXED);
+    __atomic_store_n(&pb->p, p, __ATOMIC_RELEASE);
+    __atomic_store_n(&pb->retired, old, __ATOMIC_RELEASE);
+    publishposition(pb);
+    queuesong(pb, n->number+1);
+    return true;
+  }
+  return false;
+}
+
+//main thread: frees the song the render thread has moved on from, true if
+//there was one, so the view can be set up for the new song
+bool retiresong(playback* pb)
+{
+  player* old = __atomic_load_n(&pb->retired, __ATOMIC_ACQUIRE);
+  if(old == NULL) return false;
+  if(pb->retiredsong) freesong(pb->retiredsong);
+  else
+  {
+    //the first song belongs to main()
+    freeplayer(old);
+    freeindex(&pb->retiredindex);
+  }
+  __atomic_store_n(&pb->retired, NULL, __ATOMIC_RELEASE);
+  return true;
+}
+
+//renders ticks ahead of the audio callback until the ring holds the target
+void* renderthread(void* arg)
+{
+  playback* pb = arg;
+  player* p = pb->p;
+  uint32_t tickframes = maxtickframes();
+  bool refilling = false;
+  while(!__atomic_load_n(&pb->quit, __ATOMIC_ACQUIRE))
+  {
+    int32_t ms = __atomic_exchange_n(&pb->seekms, 0, __ATOMIC_ACQ_REL);
+    int32_t orders = __atomic_exchange_n(&pb->seekorders, 0, __ATOMIC_ACQ_REL);
+    if(ms || orders)
+    {
+      seekrelative(pb, ms, orders);
+      if(pb->cache) cachereset(pb->cache);
+    }
+    //with --block, let a whole block drain and then render it in one go,
+    //rather than waking up for every tick the callback takes
+    uint32_t fill = ringfill(&pb->buffer);
+    if(fill >= pb->target || pb->buffer.size-fill < tickframes ||
+       (!refilling && fill > pb->lowwater))
+    {
+      refilling = false;
+      sleepms(pb->nap);
+      continue;
+    }
+    refilling = true;
+    if(pb->leadpos < pb->leadframes)
+    {
+      uint32_t frames = pb->leadframes-pb->leadpos;
+      if(frames > pb->buffer.size-fill) frames = pb->buffer.size-fill;
+      ringwrite(&pb->buffer, pb->lead+pb->leadpos*2, frames);
+      pb->leadpos += frames;
+      continue;
+    }
+    double start = now();
+    if(pb->cache) cachedtick(p, pb->cache);
+    else steptick(p);
+    if(p->done)
+    {
+      if(!advancesong(pb)) break;
+      p = pb->p;
+      continue;
+    }
+    int frames = p->tickframes;
+    ringwrite(&pb->buffer, mixoutput(p, frames), frames);
+    recordtick(&pb->stats, now()-start, frames/samplerate);
+    publishposition(pb);
+  }
+  __atomic_store_n(&pb->finished, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+//builds the seek index, opens the device and starts the render thread,
+//filling the ring before the device starts pulling from it
+//the caller clears pb and fills in the playlist, if there is one
+void startplayback(playback* pb, player* p, double latency)
+{
+  pb->p = p;
+  if(latency < 1) latency = 1;
+  pb->target = latency/1000*samplerate;
+  pb->nap = latency/4;
+  //a whole block has to be waiting whenever the callback asks for one
+  if(pb->target < 2*blockframes) pb->target = 2*blockframes;
+  if(blockframes && pb->nap > blockframes/samplerate*1000/2)
+    pb->nap = blockframes/samplerate*1000/2;
+  pb->lowwater = pb->target-blockframes;
+  ringinit(&pb->buffer, pb->target+maxtickframes());
+  buildindex(p, &pb->index);
+  pb->stats.tickmin = UINT32_MAX;
+  pb->stats.numchannels = p->mod->numchannels;
+  if(cachesize && p->loop)
+  {
+    pb->cache = calloc(1, sizeof(rendercache));
+    pb->cache->cap = cachesize;
+  }
+  p->stats = &pb->stats;
+  if(statsname)
+  {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = statssignal;
+    sigaction(SIGUSR1, &sa, NULL);
+  }
+  initaudio(pb);
+  p->curnote = rownote(p->mod, p->pattern, p->row);
+  if(pb->songs) queuesong(pb, pb->song+1);
+  pthread_create(&pb->thread, NULL, renderthread, pb);
+  while(ringfill(&pb->buffer) < pb->target &&
+        !__atomic_load_n(&pb->finished, __ATOMIC_ACQUIRE))
+    sleepms(1);
+  pa_error = Pa_StartStream(stream);
+  if(pa_error != paNoError) portaudioerror(pa_error);
+}
+
+//the song is over once the render thread is done and the ring is empty
+bool playbackdone(playback* pb)
+{
+  return __atomic_load_n(&pb->finished, __ATOMIC_ACQUIRE) &&
+    ringfill(&pb->buffer) == 0;
+}
+
+void stopplayback(playback* pb)
+{
+  __atomic_store_n(&pb->quit, true, __ATOMIC_RELEASE);
+  pthread_join(pb->thread, NULL);
+  pa_error = Pa_StopStream(stream);
+  if(pa_error != paNoError) portaudioerror(pa_error);
+  pa_error = Pa_CloseStream(stream);
+  if(pa_error != paNoError) portaudioerror(pa_error);
+  pa_error = Pa_Terminate();
+  if(pa_error != paNoError) portaudioerror(pa_error);
+  free(pb->buffer.data);
+  if(pb->cache)
+  {
+    snapcache(pb);
+    freecache(pb->cache);
+    free(pb->cache);
+    pb->cache = NULL;
+  }
+  pb->p->stats = NULL;
+  if(pb->next)
+  {
+    pthread_join(pb->next->thread, NULL);
+    freesong(pb->next);
+  }
+  retiresong(pb);
+  //a preloaded song is freed here, the first one is left to the caller
+  if(pb->current) freesong(pb->current);
+  else freeindex(&pb->index);
+}
+
+//title, pattern view and sample names, once the song is loaded. Called
+//before the render thread starts or while it waits for retiresong(), so p
+//and sequence hold still
+void initview(playback* pb)
+{
+  player* p = __atomic_load_n(&pb->p, __ATOMIC_ACQUIRE);
+  pb->viewplayer = p;
+  pb->viewsequence = __atomic_load_n(&pb->sequence, __ATOMIC_RELAXED);
+  //as many channels as leave room for the sample names
+  viewchannels = (COLS-30)/12;
+  if(viewchannels > p->mod->numchannels) viewchannels = p->mod->numchannels;
+  if(viewchannels < 1) viewchannels = 1;
+  patternwin = newwin(20, 12*viewchannels+1, 5, 0);
+  statswin = newwin(20, COLS, 5, 0);
+  //instrwin = newwin()
+  box(patternwin, 0, 0);
+  init_pair(5, COLOR_BLACK, COLOR_WHITE);
+  wcolor_set(patternwin, COLOR_PAIR(2), NULL);
+  wattron(patternwin, COLOR_PAIR(5));
+  //allocate buffer for pattern viewer (includes null byte at end of line)
+  displaypatterns = malloc(64*12*viewchannels+1);
+  blankline = malloc(12*viewchannels);
+  for(int i = 0; i < 12*viewchannels-1; i++)
+    blankline[i] = i%12 == 11 ? '|' : ' ';
+  blankline[12*viewchannels-1] = '\0';
+  drawsamples(p->mod, 12*viewchannels+4);
+  init_pair(3, COLOR_WHITE, COLOR_BLACK);
+  attroff(COLOR_PAIR(2));
+  attron(COLOR_PAIR(3));
+  mvprintw(3, 0, "Title: %s", p->mod->name);
+  if(pb->songs) printw("  (%d/%d)", pb->song+1, pb->numsongs);
+  attroff(COLOR_PAIR(3));
+  attron(COLOR_PAIR(2));
+}
+
+//clears the view of a song that has ended, before initview() for the next
+void freeview(void)
+{
+  delwin(patternwin);
+  delwin(statswin);
+  free(displaypatterns);
+  free(blankline);
+  move(3, 0);
+  clrtobot();
+}
+
+//keys and the pattern view, in the main thread until q or the song ends
+void runui(playback* pb)
+{
+  noecho();
+  nodelay(stdscr, true);
+  screen s;
+  initscreen(&s);
+  bool quit = false;
+  while(!quit)
+  {
+    switch(getch())
+    {
       case 'q':
-        done = true;
-        pause = false;
+        quit = true;
         break;
       case 'h':
-        headphones = !headphones;
+      {
+        player* p = __atomic_load_n(&pb->p, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&p->headphones, !p->headphones, __ATOMIC_RELAXED);
         break;
+      }
       case 'p':
-        pause = !pause;
-        nodelay(stdscr, !pause);
+        __atomic_store_n(&pb->paused, !pb->paused, __ATOMIC_RELAXED);
+        break;
+      case ',':
+        __atomic_add_fetch(&pb->seekms, -5000, __ATOMIC_RELEASE);
+        break;
+      case '.':
+        __atomic_add_fetch(&pb->seekms, 5000, __ATOMIC_RELEASE);
         break;
+      case '[':
+        __atomic_add_fetch(&pb->seekorders, -1, __ATOMIC_RELEASE);
+        break;
+      case ']':
+        __atomic_add_fetch(&pb->seekorders, 1, __ATOMIC_RELEASE);
+        break;
+      case 'i':
+        s.showstats = !s.showstats;
+        s.lastdraw = 0;
+        if(!s.showstats)
+        {
+          //bring back what the counters covered
+          touchwin(stdscr);
+          touchwin(patternwin);
+          s.status = UINT64_MAX;
+        }
+        break;
+    }
+    if(statsrequested)
+    {
+      statsrequested = 0;
+      dumpstats(pb);
+    }
+    //rebuild the view for the new song before the old one is freed
+    if(__atomic_load_n(&pb->retired, __ATOMIC_ACQUIRE))
+    {
+      freeview();
+      initview(pb);
+      bool showstats = s.showstats;
+      initscreen(&s);
+      s.showstats = showstats;
+      retiresong(pb);
+    }
+    if(playbackdone(pb)) quit = true;
+    drawscreen(pb, &s);
+    napms(10);
+  }
+}
+
+void stopsignal(int sig)
+{
+  (void)sig;
+  interrupted = 1;
+}
+
+//--quiet: no terminal output at all, plays until the end or a signal
+void runquiet(playback* pb)
+{
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stopsignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  while(!interrupted && !playbackdone(pb))
+  {
+    retiresong(pb);
+    if(statsrequested)
+    {
+      statsrequested = 0;
+      dumpstats(pb);
+    }
+    sleepms(10);
+  }
+}
+
+//render the whole song to outname as fast as possible
+bool renderoffline(player* p, char* outname, output* o)
+{
+  o->type = formatfromname(outname);
+  o->file = fopen(outname, "wb");
+  o->frames = 0;
+  o->block = 0;
+  if(o->file == NULL)
+  {
+    fprintf(stderr, "Could not open %s for writing.\n", outname);
+    return false;
+  }
+  if(o->type == OUT_WAV) wavheader(o->file, 0);
+  o->buf = malloc(maxtickframes()*8);
+  p->stopatloop = true;
+  p->curnote = rownote(p->mod, p->pattern, p->row);
+
+  while(!p->done)
+  {
+    steptick(p);
+    if(p->done) break;
+    int frames = p->tickframes;
+    if(fixedpoint) writepcm(o, mixoutputfixed(p, frames), frames);
+    else writeframes(o, mixoutput(p, frames), frames);
+  }
+
+  if(o->type == OUT_WAV && fseek(o->file, 0L, SEEK_SET) == 0)
+    wavheader(o->file, o->frames*4);
+  fclose(o->file);
+  free(o->buf);
+  return true;
+}
+
+//-o - or a FIFO: write the song out as it renders, several ticks per write()
+//and optionally no faster than realtime, for encoders and relays that read
+//from a pipe. Loops forever with -l, otherwise stops at the end of the song
+bool renderstream(player* p, char* outname, output* o, bool paced, double ms)
+{
+  if(!strcmp(outname, "-")) o->file = stdout;
+  else o->file = fopen(outname, "wb");
+  o->frames = 0;
+  o->fill = 0;
+  o->broken = false;
+  if(o->file == NULL)
+  {
+    fprintf(stderr, "Could not open %s for writing.\n", outname);
+    return false;
+  }
+  //a pipe can't be patched afterwards, so leave the sizes at their maximum,
+  //which readers take to mean a stream of unknown length
+  if(o->type == OUT_WAV)
+  {
+    wavheader(o->file, UINT32_MAX-36);
+    fflush(o->file);
+  }
+  //at least two of the longest ticks per write, ms worth if that's more
+  uint32_t tickbytes = maxtickframes()*(o->type == OUT_F32 ? 8 : 4);
+  o->block = ms/1000*samplerate*(o->type == OUT_F32 ? 8 : 4);
+  if(o->block < tickbytes*2) o->block = tickbytes*2;
+  o->buf = malloc(o->block);
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL); //EPIPE from write() ends the stream instead
+  sa.sa_handler = stopsignal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  p->stopatloop = !p->loop;
+  p->curnote = rownote(p->mod, p->pattern, p->row);
+  rendercache* cache = NULL;
+  if(cachesize && p->loop)
+  {
+    cache = calloc(1, sizeof(rendercache));
+    cache->cap = cachesize;
+  }
+
+  double start = now();
+  while(!p->done && !o->broken && !interrupted)
+  {
+    if(cache) cachedtick(p, cache);
+    else steptick(p);
+    if(p->done) break;
+    int frames = p->tickframes;
+    uint32_t fill = o->fill;
+    if(fixedpoint) writepcm(o, mixoutputfixed(p, frames), frames);
+    else writeframes(o, mixoutput(p, frames), frames);
+    //keep at most one write ahead of the wall clock
+    if(paced && o->fill < fill)
+    {
+      double ahead = (o->frames-frames)/samplerate - (now()-start);
+      if(ahead > ms/1000) sleepms(ahead*1000-ms);
+    }
+  }
+  flushstream(o);
+  if(o->file != stdout) fclose(o->file);
+  free(o->buf);
+  if(cache) freecache(cache);
+  free(cache);
+  return true;
+}
+
+void printrender(char* name, uint64_t frames, double elapsed)
+{
+  printf("%s: %llu frames (%.2fs) in %.3fs, %.0f frames/s (%.1fx realtime)\n",
+    name, (unsigned long long)frames, frames/samplerate, elapsed,
+    frames/elapsed, frames/samplerate/elapsed);
+}
+
+typedef struct{
+  char* in;
+  char* out;
+  off_t size;
+  bool ok;
+  uint64_t frames;
+  double elapsed;
+} job;
+
+//shared between the batch workers, next is the first job not yet taken
+typedef struct{
+  job* jobs;
+  int count;
+  int next;
+  player settings; //options copied into every job's player
+  pthread_mutex_t lock;
+} jobqueue;
+
+void* batchworker(void* arg)
+{
+  jobqueue* q = arg;
+  for(;;)
+  {
+    pthread_mutex_lock(&q->lock);
+    int index = q->next++;
+    pthread_mutex_unlock(&q->lock);
+    if(index >= q->count) break;
+
+    job* j = &q->jobs[index];
+    player p = q->settings;
+    output o;
+    double start = now();
+    if(!loadsong(&p, j->in))
+    {
+      fprintf(stderr, "%s: not a valid mod file, skipped.\n", j->in);
+      continue;
+    }
+    j->ok = renderoffline(&p, j->out, &o);
+    j->frames = o.frames;
+    j->elapsed = now()-start;
+    freeplayer(&p);
+    if(j->ok)
+    {
+      pthread_mutex_lock(&q->lock);
+      printrender(j->in, j->frames, j->elapsed);
+      fflush(stdout);
+      pthread_mutex_unlock(&q->lock);
+    }
+  }
+  return NULL;
+}
+
+void addjob(jobqueue* q, char* in, char* rel, off_t size, char* outdir,
+            char* ext)
+{
+  if(q->count % 64 == 0)
+    q->jobs = realloc(q->jobs, (q->count+64)*sizeof(job));
+  job* j = &q->jobs[q->count++];
+  j->in = strdup(in);
+  j->out = malloc(strlen(outdir)+strlen(rel)+strlen(ext)+3);
+  sprintf(j->out, "%s/%s.%s", outdir, rel, ext);
+  //flatten subdirectories into the output name
+  for(char* c = j->out+strlen(outdir)+1; *c; c++)
+    if(*c == '/') *c = '_';
+  j->size = size;
+  j->ok = false;
+  j->frames = 0;
+  j->elapsed = 0;
+}
+
+//queue path, descending into directories
+void collectjobs(jobqueue* q, char* path, char* rel, char* outdir, char* ext)
+{
+  struct stat s;
+  if(stat(path, &s) != 0) return;
+  if(S_ISREG(s.st_mode))
+  {
+    addjob(q, path, rel, s.st_size, outdir, ext);
+    return;
+  }
+  if(!S_ISDIR(s.st_mode)) return;
+  DIR* d = opendir(path);
+  if(d == NULL) return;
+  struct dirent* e;
+  while((e = readdir(d)) != NULL)
+  {
+    if(e->d_name[0] == '.') continue;
+    char* child = malloc(strlen(path)+strlen(e->d_name)+2);
+    char* childrel = malloc(strlen(rel)+strlen(e->d_name)+2);
+    sprintf(child, "%s/%s", path, e->d_name);
+    if(*rel) sprintf(childrel, "%s/%s", rel, e->d_name);
+    else strcpy(childrel, e->d_name);
+    collectjobs(q, child, childrel, outdir, ext);
+    free(child);
+    free(childrel);
+  }
+  closedir(d);
+}
+
+//biggest files first, so long songs don't end up alone at the end
+int jobcompare(const void* a, const void* b)
+{
+  off_t sa = ((const job*)a)->size;
+  off_t sb = ((const job*)b)->size;
+  return (sa < sb) - (sa > sb);
+}
+
+int renderbatch(player* settings, char** inputs, int numinputs,
+                char* outdir, char* ext, int threads)
+{
+  jobqueue q;
+  q.jobs = NULL;
+  q.count = 0;
+  q.next = 0;
+  q.settings = *settings;
+  pthread_mutex_init(&q.lock, NULL);
+  mkdir(outdir, 0777);
+
+  for(int i = 0; i < numinputs; i++)
+  {
+    struct stat s;
+    if(stat(inputs[i], &s) != 0) continue;
+    char* base = strrchr(inputs[i], '/');
+    base = base ? base+1 : inputs[i];
+    //a directory's contents are named relative to the directory itself
+    collectjobs(&q, inputs[i], S_ISDIR(s.st_mode) ? "" : base, outdir, ext);
+  }
+  if(q.count == 0)
+  {
+    printf("No mod files found.\n");
+    return 1;
+  }
+  qsort(q.jobs, q.count, sizeof(job), jobcompare);
+  if(threads > q.count) threads = q.count;
+
+  double start = now();
+  pthread_t* workers = malloc(threads*sizeof(pthread_t));
+  for(int i = 0; i < threads; i++)
+    pthread_create(&workers[i], NULL, batchworker, &q);
+  for(int i = 0; i < threads; i++)
+    pthread_join(workers[i], NULL);
+  double elapsed = now()-start;
+
+  uint64_t frames = 0;
+  double cputime = 0;
+  int failed = 0;
+  for(int i = 0; i < q.count; i++)
+  {
+    if(q.jobs[i].ok)
+    {
+      frames += q.jobs[i].frames;
+      cputime += q.jobs[i].elapsed;
+    }
+    else failed++;
+    free(q.jobs[i].in);
+    free(q.jobs[i].out);
+  }
+  printf("%d files (%d failed) on %d threads: %.2fs of audio in %.3fs, "
+    "%.1fx realtime (%.1fx per thread)\n", q.count, failed, threads,
+    frames/samplerate, elapsed, frames/samplerate/elapsed,
+    cputime > 0 ? frames/samplerate/cputime : 0);
+  free(q.jobs);
+  free(workers);
+  pthread_mutex_destroy(&q.lock);
+  return failed ? 1 : 0;
+}
+
+//synthetic songs for --bench, each stressing a different part of the engine
+char* benchnames[] = {"all channels busy", "vibrato/arpeggio", "short loops",
+                      "E9x retriggers", "extreme tempos"};
+
+void putcell(uint8_t* cell, int samplenum, uint16_t period, uint8_t effect,
+             uint8_t param)
+{
+  cell[0] = (samplenum&0xF0) | (period>>8);
+  cell[1] = period&0xFF;
+  cell[2] = ((samplenum&0x0F)<<4) | effect;
+  cell[3] = param;
+}
+
+//builds a whole 31 instrument mod in memory, the caller frees it
+uint8_t* benchmod(int kind, size_t* length)
+{
+  int numpatterns = 8;
+  //a long looped tone, a 4 byte loop and a one shot noise burst, in words
+  uint16_t samplelen[3] = {2048, 16, 4096};
+  uint16_t repeatlen[3] = {2048, 2, 1};
+  size_t size = 1084+1024*numpatterns;
+  for(int i = 0; i < 3; i++) size += samplelen[i]*2;
+  uint8_t* m = calloc(size, 1);
+  memcpy(m, "MFoP bench", 10);
+  for(int i = 0; i < 3; i++)
+  {
+    uint8_t* h = m+20+30*i;
+    h[22] = samplelen[i]>>8;
+    h[23] = samplelen[i]&0xFF;
+    h[24] = i == 1 ? 7 : 0; //highest finetune, so the short loop wraps fastest
+    h[25] = 64;
+    h[28] = repeatlen[i]>>8;
+    h[29] = repeatlen[i]&0xFF;
+  }
+  m[950] = numpatterns;
+  for(int i = 0; i < numpatterns; i++) m[952+i] = i;
+  memcpy(m+1080, "M.K.", 4);
+
+  uint32_t seed = kind+1;
+  for(int pat = 0; pat < numpatterns; pat++)
+    for(int row = 0; row < 64; row++)
+      for(int ch = 0; ch < 4; ch++)
+      {
+        uint8_t* cell = m+1084+1024*pat+16*row+4*ch;
+        seed = seed*1103515245+12345;
+        uint16_t period = periods[(seed>>16)%36];
+        uint8_t param = seed>>24;
+        switch(kind)
+        {
+          case 0:
+            putcell(cell, (seed>>8)&1 ? 1 : 3, period, 0x0C, param%65);
+            break;
+          case 1:
+            if(row%8 == 0) putcell(cell, 1, period, 0x04, param|0x11);
+            else if(row%8 < 4) putcell(cell, 0, 0, 0x00, param|0x11);
+            else if(row%8 < 6) putcell(cell, 0, 0, 0x04, 0);
+            else putcell(cell, 0, 0, 0x06, 0x01);
+            break;
+          case 2:
+            if(row%16 == ch*4) putcell(cell, 2, periods[24+(seed>>16)%12], 0, 0);
+            break;
+          case 3:
+            putcell(cell, (seed>>8)&1 ? 1 : 3, period, 0x0E, 0x91+(param%3));
+            break;
+          case 4:
+            //one tick rows swinging between the slowest and fastest tempos
+            if(ch == 3) putcell(cell, 1, period, 0x0F, row&1 ? 0x20 : 0xFF);
+            else if(ch == 2 && row == 0) putcell(cell, 3, period, 0x0F, 0x01);
+            else putcell(cell, (seed>>8)&1 ? 1 : 3, period, 0, 0);
+            break;
+        }
+      }
+
+  int8_t* data = (int8_t*)(m+1084+1024*numpatterns);
+  for(int i = 0; i < samplelen[0]*2; i++)
+    data[i] = 80*sin(i*2*M_PI/64)+30*sin(i*6*M_PI/64);
+  data += samplelen[0]*2;
+  for(int i = 0; i < samplelen[1]*2; i++) data[i] = i&2 ? 100 : -100;
+  data += samplelen[1]*2;
+  for(int i = 0; i < samplelen[2]*2; i++)
+  {
+    seed = seed*1103515245+12345;
+    data[i] = seed>>24;
+  }
+  *length = size;
+  return m;
+}
+
+//renderoffline() without the file, returns the number of frames rendered
+uint64_t benchrender(player* p, uint8_t* out)
+{
+  uint64_t total = 0;
+  double posttime = 0; //output filters and crossfeed
+  p->stopatloop = true;
+  p->curnote = rownote(p->mod, p->pattern, p->row);
+  while(!p->done)
+  {
+    double start = profilestart(p);
+    steptick(p);
+    profileend(p, STAGE_SEQUENCER, start);
+    if(p->done) break;
+    int frames = p->tickframes;
+    start = profilestart(p);
+    if(fixedpoint)
+    {
+      int16_t* pcm = mixoutputfixed(p, frames);
+      if(p->profile) posttime += now()-start;
+      start = profilestart(p);
+      packpcm(out, pcm, frames*2);
+    }
+    else
+    {
+      float* buf = mixoutput(p, frames);
+      if(p->profile) posttime += now()-start;
+      start = profilestart(p);
+      packs16(out, buf, frames*2);
+    }
+    profileend(p, STAGE_OUTPUT, start);
+    total += frames;
+  }
+  //the sequencer stage timed whole ticks, take out the audio work inside them
+  double* t = p->stagetime;
+  t[STAGE_SEQUENCER] -= t[STAGE_EXPAND]+t[STAGE_RESAMPLE]+t[STAGE_MIX];
+  t[STAGE_MIX] += posttime;
+  return total;
+}
+
+//renders each synthetic song headless, once for speed and once with stage
+//timing turned on, and prints the realtime factor and where the time went
+int runbench(player* settings)
+{
+  int numkinds = sizeof(benchnames)/sizeof(benchnames[0]);
+  char* stagenames[NUM_STAGES] = {"seq", "expand", "resample", "mix", "out"};
+  uint8_t* out = malloc(maxtickframes()*4);
+  uint64_t totalframes = 0;
+  double totaltime = 0;
+  headless = true;
+  printf("%s mixer, %.0fHz, %s interpolation, %s filter%s\n",
+    uselibsrc ? "libsamplerate" : fixedpoint ? "fixed point" : "built in",
+    samplerate, interpnames[interp],
+    filternames[outputfilter], settings->headphones ? ", headphones" : "");
+  printf("%-18s %8s %8s %9s ", "song", "audio", "time", "realtime");
+  for(int s = 0; s < NUM_STAGES; s++) printf(" %8s", stagenames[s]);
+  printf("\n");
+  for(int kind = 0; kind < numkinds; kind++)
+  {
+    size_t length;
+    uint8_t* image = benchmod(kind, &length);
+    uint64_t frames = 0;
+    double best = 0;
+    double stagetime[NUM_STAGES];
+    //best of three plain runs, then one profiled run for the breakdown
+    for(int run = 0; run < 4; run++)
+    {
+      player p;
+      memset(&p, 0, sizeof(player));
+      p.headphones = settings->headphones;
+      p.separation = settings->separation;
+      p.profile = run == 3;
+      if(!modparse(&p, image, length))
+      {
+        fprintf(stderr, "bench song %d did not parse\n", kind);
+        return 1;
       }
-      if(pause) goto input_loop;
+      initsound(&p);
+      double start = now();
+      frames = benchrender(&p, out);
+      double elapsed = now()-start;
+      if(run < 3 && (run == 0 || elapsed < best)) best = elapsed;
+      memcpy(stagetime, p.stagetime, sizeof(stagetime));
+      freeplayer(&p);
+    }
+    free(image);
+    double total = 0;
+    for(int s = 0; s < NUM_STAGES; s++) total += stagetime[s];
+    printf("%-18s %7.2fs %7.3fs %8.1fx ", benchnames[kind],
+      frames/samplerate, best, frames/samplerate/best);
+    for(int s = 0; s < NUM_STAGES; s++)
+      printf(" %7.1f%%", total > 0 ? 100*stagetime[s]/total : 0);
+    printf("\n");
+    totalframes += frames;
+    totaltime += best;
+  }
+  printf("%-18s %7.2fs %7.3fs %8.1fx\n", "total", totalframes/samplerate,
+    totaltime, totalframes/samplerate/totaltime);
+  free(out);
+  return 0;
+}
 
-    //break;
-    steptick(gcp);
-    if(headphones)
+//what decides how the song carries on after the first tick of a row
+typedef struct{
+  uint8_t order;
+  uint8_t row;
+  uint8_t nextorder;
+  uint8_t nextrow;
+  uint8_t speed;
+  uint8_t tempo;
+  uint8_t delcount;
+  bool addflag;
+  bool patternset;
+  int8_t looppoint[MAX_CHANNELS]; //unused ones stay zero
+  int8_t loopcount[MAX_CHANNELS];
+} songstate;
+
+typedef struct{
+  songstate state;
+  double time;
+  bool used;
+} stateslot;
+
+typedef struct{
+  double duration; //seconds until the song ends or starts repeating
+  double loopstart; //where the repeat goes back to, negative if it just ends
+  int orders; //distinct orders played
+} scanresult;
+
+uint32_t hashstate(songstate* s)
+{
+  uint8_t* bytes = (uint8_t*)s;
+  uint32_t h = 2166136261u; //FNV-1a
+  for(size_t i = 0; i < sizeof(songstate); i++) h = (h^bytes[i])*16777619u;
+  return h;
+}
+
+/*runs only the sequencer and effects over the song, with the sample
+  positions moved on arithmetically, until it ends or reaches the start of
+  a row in a state it has been in before, which means it loops forever*/
+void scansong(player* p, scanresult* r)
+{
+  uint32_t capacity = 1024;
+  uint32_t count = 0;
+  stateslot* slots = calloc(capacity, sizeof(stateslot));
+  bool played[128] = {false};
+  double time = 0;
+  p->silent = true;
+  p->loop = false;
+  p->curnote = rownote(p->mod, p->pattern, p->row);
+  r->loopstart = -1;
+  r->orders = 0;
+  //give up after a day of song time, though a state always repeats
+  while(!p->done && time < 86400)
+  {
+    bool rowstart = p->globaltick == 0 && !p->inrepeat;
+    double start = time;
+    steptick(p);
+    if(p->done) break;
+    time += p->ticktime;
+    if(!rowstart) continue;
+    if(!played[p->curpattern])
+    {
+      played[p->curpattern] = true;
+      r->orders++;
+    }
+    songstate s;
+    memset(&s, 0, sizeof(songstate));
+    s.order = p->curpattern;
+    s.row = p->currow;
+    s.nextorder = p->pattern;
+    s.nextrow = p->row;
+    s.speed = p->mod->speed;
+    s.tempo = p->mod->tempo;
+    s.delcount = p->delcount;
+    s.addflag = p->addflag;
+    s.patternset = p->patternset;
+    for(int i = 0; i < p->mod->numchannels; i++)
+    {
+      s.looppoint[i] = p->channels[i].looppoint;
+      s.loopcount[i] = p->channels[i].loopcount;
+    }
+    uint32_t slot = hashstate(&s) & (capacity-1);
+    while(slots[slot].used && memcmp(&slots[slot].state, &s, sizeof(s)))
+      slot = (slot+1) & (capacity-1);
+    if(slots[slot].used)
+    {
+      r->loopstart = slots[slot].time;
+      time = start;
+      break;
+    }
+    slots[slot].state = s;
+    slots[slot].time = start;
+    slots[slot].used = true;
+    //keep the table at most half full
+    if(++count*2 > capacity)
     {
-      float* in = audiobuf;
-      float* out = mixbuf;
-      for(unsigned int i = 0; i < ticktime*SAMPLE_RATE; i++)
+      stateslot* old = slots;
+      capacity *= 2;
+      slots = calloc(capacity, sizeof(stateslot));
+      for(uint32_t i = 0; i < capacity/2; i++)
       {
-        float l = *in++;
-        float r = *in++;
-        *out++ = l+0.5*r;
-        *out++ = r+0.5*l;
+        if(!old[i].used) continue;
+        uint32_t j = hashstate(&old[i].state) & (capacity-1);
+        while(slots[j].used) j = (j+1) & (capacity-1);
+        slots[j] = old[i];
       }
-      pa_error = Pa_WriteStream(stream, mixbuf, ticktime*SAMPLE_RATE);
+      free(old);
+    }
+  }
+  r->duration = time;
+  free(slots);
+}
+
+int jobnamecompare(const void* a, const void* b)
+{
+  return strcmp(((job*)a)->in, ((job*)b)->in);
+}
+
+//--scan: one line per mod with duration and loop start in microseconds
+int scansongs(char** inputs, int numinputs)
+{
+  jobqueue q;
+  memset(&q, 0, sizeof(jobqueue));
+  headless = true;
+  for(int i = 0; i < numinputs; i++) collectjobs(&q, inputs[i], "", "", "");
+  qsort(q.jobs, q.count, sizeof(job), jobnamecompare);
+  int failed = 0;
+  printf("duration_us\tloop_us\torders\tfile\n");
+  for(int i = 0; i < q.count; i++)
+  {
+    player p;
+    memset(&p, 0, sizeof(player));
+    if(!loadsong(&p, q.jobs[i].in))
+    {
+      fprintf(stderr, "%s: not a valid mod file, skipped.\n", q.jobs[i].in);
+      failed++;
     }
     else
-      pa_error = Pa_WriteStream(stream, audiobuf, ticktime*SAMPLE_RATE);
+    {
+      scanresult r;
+      scansong(&p, &r);
+      printf("%lld\t%lld\t%d\t%s\n", llround(r.duration*1e6),
+        r.loopstart < 0 ? -1LL : llround(r.loopstart*1e6), r.orders,
+        q.jobs[i].in);
+      freeplayer(&p);
+    }
+    free(q.jobs[i].in);
+    free(q.jobs[i].out);
+  }
+  free(q.jobs);
+  return failed ? 1 : 0;
+}
+
+bool isplaylist(char* name)
+{
+  char* ext = strrchr(name, '.');
+  return ext && (!strcmp(ext, ".m3u") || !strcmp(ext, ".m3u8"));
+}
+
+//copies of the inputs, with .m3u playlists replaced by the files they list,
+//one per line and relative to the playlist, skipping # comments
+char** listsongs(char** inputs, int numinputs, int* numsongs)
+{
+  int cap = numinputs+16;
+  char** songs = malloc(cap*sizeof(char*));
+  int n = 0;
+  for(int i = 0; i < numinputs; i++)
+  {
+    FILE* f = isplaylist(inputs[i]) ? fopen(inputs[i], "r") : NULL;
+    if(f == NULL)
+    {
+      if(n == cap) songs = realloc(songs, (cap *= 2)*sizeof(char*));
+      songs[n++] = strdup(inputs[i]);
+      continue;
+    }
+    char* slash = strrchr(inputs[i], '/');
+    int dirlength = slash ? slash-inputs[i]+1 : 0;
+    char line[4096];
+    while(fgets(line, sizeof(line), f))
+    {
+      char* name = line;
+      if(!strncmp(name, "\xEF\xBB\xBF", 3)) name += 3; //m3u8 byte order mark
+      name[strcspn(name, "\r\n")] = '\0';
+      if(*name == '\0' || *name == '#') continue;
+      int dir = *name == '/' ? 0 : dirlength;
+      if(n == cap) songs = realloc(songs, (cap *= 2)*sizeof(char*));
+      songs[n] = malloc(dir+strlen(name)+1);
+      sprintf(songs[n++], "%.*s%s", dir, inputs[i], name);
+    }
+    fclose(f);
+  }
+  *numsongs = n;
+  return songs;
+}
+
+void freesongs(char** songs, int numsongs)
+{
+  for(int i = 0; i < numsongs; i++) free(songs[i]);
+  free(songs);
+}
+
+char* filename;
+char* outname;
+int main(int argc, char *argv[])
+{
+  if(argc < 2) goto fileerror;
+  uithread = pthread_self();
+  player song;
+  memset(&song, 0, sizeof(player));
+  song.headphones = false;
+  song.loop = false;
+  song.separation = 100;
+  char** inputs = malloc(argc*sizeof(char*));
+  int numinputs = 0;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  char* ext = "wav";
+  double latency = 100; //ms of audio to keep rendered ahead
+  bool bench = false;
+  bool scan = false;
+  bool paced = false; //stream no faster than realtime
+  for(int i = 1; i < argc; i++)
+  {
+    switch(*argv[i])
+    {
+      case '-':
+        switch(*(argv[i]+1))
+        {
+          case 'h':
+            song.headphones = true;
+            break;
+          case 'l':
+            song.loop = true;
+            break;
+          case 'o':
+            if(i+1 < argc) outname = argv[++i];
+            headless = true;
+            break;
+          case 's':
+            uselibsrc = true;
+            break;
+          case 'j':
+            if(i+1 < argc) threads = atoi(argv[++i]);
+            break;
+          case 'f':
+            if(i+1 < argc) ext = argv[++i];
+            break;
+          case 'b':
+            if(i+1 < argc) latency = atof(argv[++i]);
+            break;
+          case 'r':
+            if(i+1 < argc) samplerate = atof(argv[++i]);
+            break;
+          case 'p':
+            if(i+1 < argc)
+            {
+              int percent = atoi(argv[++i]);
+              song.separation = percent < 0 ? 0 : percent > 100 ? 100 : percent;
+            }
+            break;
+          case '-':
+            if(!strcmp(argv[i]+2, "bench")) bench = true;
+            else if(!strcmp(argv[i]+2, "scan")) scan = true;
+            else if(!strcmp(argv[i]+2, "quiet")) quiet = true;
+            else if(!strcmp(argv[i]+2, "paced")) paced = true;
+            else if(!strcmp(argv[i]+2, "fixed")) fixedpoint = true;
+            else if(!strcmp(argv[i]+2, "cache") && i+1 < argc)
+              cachesize = atof(argv[++i])*1024*1024;
+            else if(!strcmp(argv[i]+2, "stats") && i+1 < argc)
+              statsname = argv[++i];
+            else if(!strcmp(argv[i]+2, "latency") && i+1 < argc)
+              devicelatency = argv[++i];
+            else if(!strcmp(argv[i]+2, "block") && i+1 < argc)
+              blockframes = atol(argv[++i]);
+            else if(!strcmp(argv[i]+2, "filter") && i+1 < argc)
+            {
+              i++;
+              int model = 0;
+              while(model < NUM_FILTERS && strcmp(argv[i], filternames[model]))
+                model++;
+              if(model == NUM_FILTERS)
+              {
+                printf("Unknown filter %s, use none, led, a500 or a1200.\n",
+                  argv[i]);
+                free(inputs);
+                return 1;
+              }
+              outputfilter = model;
+            }
+            else if(!strcmp(argv[i]+2, "interp") && i+1 < argc)
+            {
+              i++;
+              int tier = 0;
+              while(tier < NUM_INTERPS && strcmp(argv[i], interpnames[tier]))
+                tier++;
+              if(tier == NUM_INTERPS)
+              {
+                printf("Unknown interpolation %s, use nearest, linear, cubic or sinc.\n",
+                  argv[i]);
+                free(inputs);
+                return 1;
+              }
+              interp = tier;
+            }
+            break;
+        }
+        break;
+      default:
+        inputs[numinputs++] = argv[i];
+        filename = argv[i];
+    }
+  }
+  if(threads < 1) threads = 1;
+  //the A500's 4.4kHz low pass needs to fit under Nyquist
+  samplerate = round(samplerate);
+  if(samplerate < 11025 || samplerate > 192000)
+  {
+    printf("Output rate %g is out of range, use 11025 to 192000.\n",
+      samplerate);
+    free(inputs);
+    return 1;
+  }
+  if(strcmp(devicelatency, "low") && strcmp(devicelatency, "high") &&
+     atof(devicelatency) <= 0)
+  {
+    printf("Unknown latency %s, use low, high or a number of ms.\n",
+      devicelatency);
+    free(inputs);
+    return 1;
+  }
+  if(blockframes && (blockframes < 16 || blockframes > 8192))
+  {
+    printf("Block size %lu is out of range, use 16 to 8192 frames.\n",
+      blockframes);
+    free(inputs);
+    return 1;
+  }
+  if(fixedpoint && (uselibsrc || interp > INTERP_LINEAR))
+  {
+    printf("The fixed point engine only does nearest and linear interpolation, without -s.\n");
+    free(inputs);
+    return 1;
+  }
+  precalculatetables();
+  selectkernels();
+  if(bench)
+  {
+    free(inputs);
+    return runbench(&song);
+  }
+  int numsongs;
+  char** songs = listsongs(inputs, numinputs, &numsongs);
+  free(inputs);
+  if(scan)
+  {
+    int ret = numsongs ? scansongs(songs, numsongs) : 1;
+    freesongs(songs, numsongs);
+    if(!numsongs) goto fileerror;
+    return ret;
+  }
+  if(numsongs == 0)
+  {
+    free(songs);
+    goto fileerror;
+  }
+  filename = songs[0];
+
+  //several inputs or a directory get rendered in parallel into outname,
+  //several inputs without -o are played as a playlist
+  struct stat s;
+  if((numsongs > 1 && headless) ||
+     (stat(filename, &s) == 0 && S_ISDIR(s.st_mode)))
+  {
+    if(outname == NULL)
+    {
+      printf("Please specify an output directory with -o.\n");
+      freesongs(songs, numsongs);
+      return 1;
+    }
+    headless = true;
+    int ret = renderbatch(&song, songs, numsongs, outname, ext, threads);
+    freesongs(songs, numsongs);
+    return ret;
+  }
 
-    if(pa_error != paNoError && pa_error != paOutputUnderflowed)
-      portaudioerror(pa_error);
+  //stdout and FIFOs are streamed, everything else is a file we can seek in
+  if(headless && outname != NULL && (!strcmp(outname, "-") ||
+     (stat(outname, &s) == 0 && !S_ISREG(s.st_mode))))
+  {
+    bool ok = loadsong(&song, filename);
+    if(ok)
+    {
+      output o;
+      if(!strcmp(outname, "-"))
+      {
+        char name[16] = "-.";
+        strncat(name, ext, sizeof(name)-3);
+        o.type = formatfromname(name);
+      }
+      else o.type = formatfromname(outname);
+      double start = now();
+      ok = renderstream(&song, outname, &o, paced, latency);
+      if(ok && !quiet)
+      {
+        fprintf(stderr, "%s: %llu frames (%.2fs) in %.3fs\n", outname,
+          (unsigned long long)o.frames, o.frames/samplerate, now()-start);
+      }
+      freeplayer(&song);
+    }
+    else printf("Please specify a valid mod file.\n");
+    freesongs(songs, numsongs);
+    return ok ? 0 : 1;
   }
 
-  for(int i = 0; i < 4; i++)
+  if(headless)
   {
-    src_delete(gcp[i].converter);
-    free(gcp[i].buffer);
-    free(gcp[i].resampled);
-    free(gcp[i].cdata);
+    bool ok = outname != NULL && loadsong(&song, filename);
+    if(ok)
+    {
+      output o;
+      double start = now();
+      ok = renderoffline(&song, outname, &o);
+      if(ok) printrender(outname, o.frames, now()-start);
+      freeplayer(&song);
+    }
+    else printf("Please specify a valid mod file.\n");
+    freesongs(songs, numsongs);
+    return ok ? 0 : 1;
   }
-  free(gcp);
-  free(audiobuf);
-  free(mixbuf);
-  for(int i = 0; i < numsamples; i++)
+
+  player* p = &song;
+  playback pb;
+  memset(&pb, 0, sizeof(playback));
+  if(numsongs > 1)
   {
-    if(gm->samples[i]->length) free(gm->samples[i]->sampledata);
-    free(gm->samples[i]);
+    //each song plays once through, -l repeats the whole list instead
+    pb.songs = songs;
+    pb.numsongs = numsongs;
+    pb.repeat = song.loop;
+    song.loop = false;
+    song.stopatloop = true;
+    pb.settings = song;
   }
-  free(gm->patterns);
-  free(gm);
-  free(displaypatterns);
-  pa_error = Pa_StopStream(stream);
-  if(pa_error != paNoError) portaudioerror(pa_error);
-  pa_error = Pa_CloseStream(stream);
-  if(pa_error != paNoError) portaudioerror(pa_error);
-  pa_error = Pa_Terminate();
-  if(pa_error != paNoError) portaudioerror(pa_error);
-  attroff(COLOR_PAIR(1));
-  attroff(COLOR_PAIR(2));
-  attroff(COLOR_PAIR(5));
-  endwin();
+  if(!quiet)
+  {
+    initscr();
+    start_color();
+    curs_set(0);
+    init_pair(1, COLOR_YELLOW, COLOR_BLACK);
+    attron(COLOR_PAIR(1));
+    printw("MFoP 1.1.4: A tiny ProTracker MOD player\nBaked with love\n");
+    attroff(COLOR_PAIR(1));
+    init_pair(2, COLOR_BLUE, COLOR_BLACK);
+    attron(COLOR_PAIR(2));
+    refresh();
+  }
+  //a playlist starts at the first song that loads
+  player settings = song;
+  while(!loadsong(p, songs[pb.song]))
+  {
+    *p = settings;
+    if(++pb.song == numsongs)
+    {
+      if(!quiet) endwin();
+      freesongs(songs, numsongs);
+      goto fileerror;
+    }
+  }
+  pb.p = p;
+  if(quiet)
+  {
+    startplayback(&pb, p, latency);
+    runquiet(&pb);
+  }
+  else
+  {
+    initview(&pb);
+    startplayback(&pb, p, latency);
+    runui(&pb);
+  }
+  stopplayback(&pb);
+  //the first song is only still ours if the playlist never got past it
+  if(pb.current == NULL) freeplayer(p);
+  if(!quiet)
+  {
+    freeview();
+    attroff(COLOR_PAIR(1));
+    attroff(COLOR_PAIR(2));
+    attroff(COLOR_PAIR(5));
+    endwin();
+  }
+  if(statsname) dumpstats(&pb);
+  freesongs(songs, numsongs);
   return 0;
 
   fileerror: